@@ -0,0 +1,114 @@
+/* Microbenchmark of FTP command lookup, run with `make -C src bench`
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Times find_command(), the perfect hash dispatch() uses, against the
+ * string compares down supported[] it replaced.  The real ftpcmd.c is
+ * included, for its static functions, and linked with the rest of uftpd,
+ * where main() is renamed, see Makefile.am.
+ */
+#include "ftpcmd.c"
+#undef main
+
+#define ROUNDS 1000000
+
+/* Before the perfect hash, commands unknown to us walk all of it */
+static ftp_cmd_t *find_linear(char *command)
+{
+	ftp_cmd_t *cmd;
+
+	for (cmd = &supported[0]; cmd->command; cmd++) {
+		if (string_compare(command, cmd->command))
+			return cmd;
+	}
+
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Nanoseconds per lookup of each of @words, @rounds times */
+static double run(ftp_cmd_t *(*find)(char *), char **words, int num, long rounds)
+{
+	volatile uintptr_t sink = 0;
+	double start;
+
+	start = now();
+	for (long r = 0; r < rounds; r++) {
+		for (int i = 0; i < num; i++)
+			sink += (uintptr_t)find(words[i]);
+	}
+
+	return (now() - start) * 1e9 / (rounds * num);
+}
+
+int main(int argc, char *argv[])
+{
+	char *unknown[] = { "SITE", "ALLO", "XPWD", "ACCT", "FOOBAR" };
+	char *words[NELEMS(supported) + NELEMS(unknown)];
+	long rounds = ROUNDS;
+	int i, num = 0;
+
+	if (argc > 1)
+		rounds = atol(argv[1]);
+	if (rounds < 1)
+		rounds = ROUNDS;
+
+	loglevel = LOG_ERR;
+	hash_commands();
+	if (cmd_linear) {
+		fprintf(stderr, "Commands collide, update CMD_HASH_MULT\n");
+		return 1;
+	}
+
+	/* Command words come from ctrl->buf, never string literals */
+	for (i = 0; supported[i].command; i++)
+		words[num++] = strdup(supported[i].command);
+	for (i = 0; i < (int)NELEMS(unknown); i++)
+		words[num++] = strdup(unknown[i]);
+
+	for (i = 0; i < num; i++) {
+		if (!words[i] || find_command(words[i]) != find_linear(words[i])) {
+			fprintf(stderr, "Lookup of %s differs\n", words[i] ? words[i] : "?");
+			return 1;
+		}
+	}
+
+	printf("FTP command lookup, %d known and %zu unknown words, %ld rounds\n",
+	       num - (int)NELEMS(unknown), NELEMS(unknown), rounds);
+	printf("  supported[] walk  %6.1f ns/lookup\n", run(find_linear,  words, num, rounds));
+	printf("  perfect hash      %6.1f ns/lookup\n", run(find_command, words, num, rounds));
+
+	/* Worst case of the walk, a command we do not know */
+	printf("  walk, unknown     %6.1f ns/lookup\n", run(find_linear,  &words[num - 1], 1, rounds));
+	printf("  hash, unknown     %6.1f ns/lookup\n", run(find_command, &words[num - 1], 1, rounds));
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
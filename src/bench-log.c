@@ -0,0 +1,131 @@
+/* Microbenchmark of disabled debug messages, run with `make -C src bench`
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A loop standing in for the data path, a checksum of one TFTP block,
+ * with a DBG() per block like the ones in LIST, TFTP and compose_path(),
+ * at the default log level, where debug messages are filtered out.  It
+ * is timed without any DBG(), with DBG() as built, filtered at runtime or
+ * compiled out with configure --disable-debug, and with LOGIT() as it was
+ * before, evaluating its arguments and calling logit() to filter them.
+ */
+#include "uftpd.h"
+#undef main
+
+#define ROUNDS 2000000
+#define BLOCK  512
+
+/* LOGIT() before the level check, strerror() and logit() every time */
+#define OLD_DBG(fmt, args...) logit(LOG_DEBUG, fmt "%s", ##args, do_syslog ? "" : "\n")
+
+#ifdef DISABLE_DEBUG
+#define DBG_HOW "compiled out"
+#else
+#define DBG_HOW "filtered"
+#endif
+
+static uint8_t block[BLOCK];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t sum(long num)
+{
+	uint32_t csum = 0;
+
+	for (size_t i = 0; i < sizeof(block); i++)
+		csum += block[i] ^ num;
+
+	return csum;
+}
+
+static double run_none(long rounds)
+{
+	volatile uint32_t sink = 0;
+	double start = now();
+
+	for (long num = 0; num < rounds; num++)
+		sink += sum(num);
+
+	return (now() - start) * 1e9 / rounds;
+}
+
+static double run_dbg(long rounds)
+{
+	volatile uint32_t sink = 0;
+	double start = now();
+
+	for (long num = 0; num < rounds; num++) {
+		sink += sum(num);
+		DBG("Block %ld sent, checksum %u: %s", num, sink, strerror(errno));
+	}
+
+	return (now() - start) * 1e9 / rounds;
+}
+
+static double run_old(long rounds)
+{
+	volatile uint32_t sink = 0;
+	double start = now();
+
+	for (long num = 0; num < rounds; num++) {
+		sink += sum(num);
+		OLD_DBG("Block %ld sent, checksum %u: %s", num, sink, strerror(errno));
+	}
+
+	return (now() - start) * 1e9 / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+	long rounds = ROUNDS;
+	double none, dbg, old;
+
+	if (argc > 1)
+		rounds = atol(argv[1]);
+	if (rounds < 1)
+		rounds = ROUNDS;
+
+	loglevel  = LOG_NOTICE;
+	do_syslog = 0;
+	memset(block, 0xa5, sizeof(block));
+
+	/* Warm up, then the same order every time */
+	run_none(rounds / 10);
+	none = run_none(rounds);
+	dbg  = run_dbg(rounds);
+	old  = run_old(rounds);
+
+	printf("Debug messages at -l notice, %d byte block, %ld rounds\n", BLOCK, rounds);
+	printf("  no DBG()              %6.1f ns/block\n", none);
+	printf("  DBG(), %-14s %6.1f ns/block, %+.1f ns\n", DBG_HOW, dbg, dbg - none);
+	printf("  old LOGIT()           %6.1f ns/block, %+.1f ns\n", old, old - none);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
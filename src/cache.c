@@ -0,0 +1,160 @@
+/* Cache of pre-rendered directory listings, shared by all sessions
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uftpd.h"
+
+/*
+ * The cache is a direct mapped table of fixed size slots in a shared
+ * memory mapping, set up before any session is forked.  Each slot is
+ * guarded by a sequence counter, odd while a session is writing to it.
+ * Readers copy the data out and only use it if the counter was even and
+ * unchanged across the copy, so no session ever waits for another.
+ */
+typedef struct {
+	uint32_t seq;
+	lskey_t  key;
+	size_t   len;
+	char     data[];
+} slot_t;
+
+static char  *cache;
+static size_t cache_slots;
+
+static slot_t *slot(lskey_t *key)
+{
+	uint32_t hash = 2166136261u;
+	uint8_t *ptr = (uint8_t *)key;
+
+	/* FNV-1a */
+	for (size_t i = 0; i < sizeof(*key); i++) {
+		hash ^= ptr[i];
+		hash *= 16777619u;
+	}
+
+	return (slot_t *)&cache[(hash % cache_slots) * CACHE_SLOTSZ];
+}
+
+/* Set up @num slots, must be called before forking any sessions */
+int cache_init(int num)
+{
+	if (num <= 0)
+		return 0;
+
+	cache = shm_alloc((size_t)num * CACHE_SLOTSZ);
+	if (!cache) {
+		ERR(errno, "Failed allocating listing cache, %d slots", num);
+		return 1;
+	}
+	cache_slots = num;
+
+	INFO("Listing cache enabled, %d slots of %d kiB", num, CACHE_SLOTSZ / 1024);
+
+	return 0;
+}
+
+/*
+ * Key for listing directory @st in the current mode.  A directory's
+ * mtime changes when entries are added, removed or renamed, not when a
+ * file in it is modified, so sizes and times may lag until then.
+ */
+int cache_key(ctrl_t *ctrl, struct stat *st, lskey_t *key)
+{
+	if (!cache)
+		return 1;
+
+	memset(key, 0, sizeof(*key));
+	key->dev   = st->st_dev;
+	key->ino   = st->st_ino;
+	key->mtime = st->st_mtim;
+	key->mode  = ctrl->list_mode;
+	strlcpy(key->facts, ctrl->facts, sizeof(key->facts));
+
+	return 0;
+}
+
+/* On hit, returns a malloc'ed copy of the listing in @buf */
+int cache_get(lskey_t *key, char **buf, size_t *len)
+{
+	slot_t *s;
+	uint32_t seq;
+	char *data;
+
+	if (!cache)
+		return 1;
+
+	s = slot(key);
+	seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1 || memcmp(&s->key, key, sizeof(*key)))
+		return 1;
+
+	*len = s->len;
+	if (*len > CACHE_SLOTSZ - sizeof(slot_t))
+		return 1;
+
+	data = malloc(*len + 1);
+	if (!data)
+		return 1;
+	memcpy(data, s->data, *len);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) {
+		free(data);
+		return 1;
+	}
+
+	*buf = data;
+
+	return 0;
+}
+
+/* Store listing, silently skipped if the slot is busy or it is too big */
+void cache_put(lskey_t *key, char *buf, size_t len)
+{
+	uint32_t seq;
+	slot_t *s;
+
+	if (!cache || len > CACHE_SLOTSZ - sizeof(slot_t))
+		return;
+
+	/*
+	 * Timestamps have limited granularity, a directory modified in the
+	 * same second as we read it may change again without changing its
+	 * mtime.  Do not cache it until it has settled, like git does.
+	 */
+	if (key->mtime.tv_sec >= time(NULL) - 1)
+		return;
+
+	s = slot(key);
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	if (seq & 1)
+		return;
+	if (!__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	memcpy(&s->key, key, sizeof(*key));
+	memcpy(s->data, buf, len);
+	s->len = len;
+
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
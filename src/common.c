@@ -16,8 +16,22 @@
  */
 
 #include "uftpd.h"
+#include <linux/filter.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_OPENAT2_H
+#include <linux/openat2.h>
+#endif
 
 int chrooted = 0;
+int forked   = 0;
+
+/* Ended sessions sharing the event loop, see session_exit() */
+static ctrl_t *dying, *dead;
+static uev_t   reaper;
+
+#ifdef HAVE_LINUX_OPENAT2_H
+static int no_openat2 = 0;	/* Kernel < 5.6 */
+#endif
 
 /* Protect against common directory traversal attacks, for details see
  * https://en.wikipedia.org/wiki/Directory_traversal_attack
@@ -29,21 +43,23 @@ int chrooted = 0;
  * User input ---------------'
  *
  * Forced dir ------> /srv/ftp/etc
+ *
+ * The result is written to @buf, which is returned, or NULL on error.
  */
-char *compose_path(ctrl_t *ctrl, char *path)
+static char *compose(char *cwd, char *path, char *buf, size_t buflen)
 {
-	static char rpath[PATH_MAX];
+	char rpath[PATH_MAX];
 	char dir[PATH_MAX] = { 0 };
 	char *name, *ptr;
 	struct stat st;
 
-	strlcpy(dir, ctrl->cwd, sizeof(dir));
-	DBG("Compose path from cwd: %s, arg: %s", ctrl->cwd, path ?: "");
+	strlcpy(dir, cwd, sizeof(dir));
+	DBG("Compose path from cwd: %s, arg: %s", cwd, path ?: "");
 	if (!path || !strlen(path))
 		goto check;
 
 	if (path[0] != '/') {
-		if (dir[strlen(dir) - 1] != '/')
+		if (!dir[0] || dir[strlen(dir) - 1] != '/')
 			strlcat(dir, "/", sizeof(dir));
 	}
 	strlcat(dir, path, sizeof(dir));
@@ -109,26 +125,139 @@ check:
 	}
 
 	DBG("Final path to file: %s", rpath);
+	if (strlcpy(buf, rpath, buflen) >= buflen) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return buf;
+}
+
+char *compose_path(ctrl_t *ctrl, char *path, char *buf, size_t len)
+{
+	return compose(ctrl->cwd, path, buf, len);
+}
+
+/* Like compose_path(), but an absolute @path is not relative to the cwd */
+char *compose_abspath(ctrl_t *ctrl, char *path, char *buf, size_t len)
+{
+	if (path && path[0] == '/')
+		return compose("", path, buf, len);
+
+	return compose(ctrl->cwd, path, buf, len);
+}
+
+#ifdef HAVE_LINUX_OPENAT2_H
+/*
+ * Join @path to the session cwd, unless absolute, and squash any . and
+ * .. components the way the client sees it: .. at the root stays at the
+ * root.  The result is relative to the FTP root, "." for the root.
+ */
+static int path_norm(ctrl_t *ctrl, char *path, char *buf, size_t len)
+{
+	char tmp[PATH_MAX], *tok, *sp;
+	size_t n = 0;
+
+	if (path[0] == '/')
+		strlcpy(tmp, path, sizeof(tmp));
+	else if ((size_t)snprintf(tmp, sizeof(tmp), "%s/%s", ctrl->cwd, path) >= sizeof(tmp))
+		return -1;
+
+	buf[0] = 0;
+	for (tok = strtok_r(tmp, "/", &sp); tok; tok = strtok_r(NULL, "/", &sp)) {
+		if (!strcmp(tok, "."))
+			continue;
+
+		if (!strcmp(tok, "..")) {
+			char *ptr = strrchr(buf, '/');
 
-	return rpath;
+			n = ptr ? (size_t)(ptr - buf) : 0;
+			buf[n] = 0;
+			continue;
+		}
+
+		if (n + !!n + strlen(tok) >= len)
+			return -1;
+		if (n)
+			buf[n++] = '/';
+		n += strlcpy(&buf[n], tok, len - n);
+	}
+
+	if (!n)
+		strlcpy(buf, ".", len);
+
+	return 0;
 }
+#endif
 
-char *compose_abspath(ctrl_t *ctrl, char *path)
+/*
+ * Open @path, as given by the client, relative to the FTP root.  With
+ * openat2() the kernel does the walk from the session's root directory,
+ * with the cwd joined in, refusing anything resolving outside the root,
+ * e.g. via a /proc magic link, so there is no need to run the path
+ * through realpath() first.  Symlinks may point anywhere in the root,
+ * also above the cwd.  When chrooted, absolute symlinks resolve in the
+ * FTP root, as they do for the kernel, without chroot they are refused.
+ * Kernels older than 5.6 fall back to compose_abspath() and open().
+ */
+int open_path(ctrl_t *ctrl, char *path, int flags, mode_t mode)
 {
+	char rpath[PATH_MAX];
 	char *ptr;
-	char cwd[sizeof(ctrl->cwd)];
 
-	if (path && path[0] == '/') {
-		strlcpy(cwd, ctrl->cwd, sizeof(cwd));
-		memset(ctrl->cwd, 0, sizeof(ctrl->cwd));
+	if (!path)
+		path = "";
+
+#ifdef HAVE_LINUX_OPENAT2_H
+	if (!no_openat2 && ctrl->root_fd >= 0) {
+		struct open_how how = {
+			.flags   = flags | O_CLOEXEC,
+			.mode    = (flags & O_CREAT) ? mode : 0,
+			.resolve = (chrooted ? RESOLVE_IN_ROOT : RESOLVE_BENEATH) | RESOLVE_NO_MAGICLINKS,
+		};
+		char rel[PATH_MAX];
+		int fd;
+
+		if (path_norm(ctrl, path, rel, sizeof(rel))) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		fd = syscall(SYS_openat2, ctrl->root_fd, rel, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS)
+			return fd;
+
+		DBG("No openat2() support in kernel, falling back to realpath()");
+		no_openat2 = 1;
 	}
+#endif
 
-	ptr = compose_path(ctrl, path);
+	ptr = compose_abspath(ctrl, path, rpath, sizeof(rpath));
+	if (!ptr)
+		return -1;
 
-	if (path && path[0] == '/')
-		strlcpy(ctrl->cwd, cwd, sizeof(ctrl->cwd));
+	return open(ptr, flags | O_CLOEXEC, mode);
+}
 
-	return ptr;
+/* Like fopen(), "r" or "w" only, a read never blocks on a FIFO */
+FILE *fopen_path(ctrl_t *ctrl, char *path, char *mode)
+{
+	int flags = O_RDONLY | O_NONBLOCK;
+	FILE *fp;
+	int fd;
+
+	if (mode[0] == 'w')
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	fd = open_path(ctrl, path, flags, 0666);
+	if (fd < 0)
+		return NULL;
+
+	fp = fdopen(fd, mode);
+	if (!fp)
+		close(fd);
+
+	return fp;
 }
 
 int set_nonblock(int fd)
@@ -142,7 +271,32 @@ int set_nonblock(int fd)
 	return fd;
 }
 
-int open_socket(sa_family_t family, int port, int type, char *desc)
+/* Memory shared with all sessions forked after this call */
+void *shm_alloc(size_t len)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	return ptr;
+}
+
+/* Raise soft limit on open files to the hard limit, for many descriptors */
+void nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == rl.rlim_max)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		WARN(errno, "Failed raising max open files");
+}
+
+int open_socket(sa_family_t family, int port, int type, int reuseport, char *desc)
 {
 	int sd, err, val = 1;
 	inet_addr_t server;
@@ -158,6 +312,19 @@ int open_socket(sa_family_t family, int port, int type, char *desc)
 	if (err != 0)
 		WARN(errno, "Failed setting SO_REUSEADDR on %s socket", type == SOCK_DGRAM ? "TFTP" : "FTP");
 
+	/*
+	 * Shards, one socket each bound to the same port, see serve_files().
+	 * Never on PASV ports, any process of the same user could then bind
+	 * one of them as well and steal the data connections of sessions.
+	 */
+	if (reuseport && port) {
+		if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+			WARN(errno, "Failed setting SO_REUSEPORT on %s socket", desc);
+			close(sd);
+			return -1;
+		}
+	}
+
 #ifdef ENABLE_IPV6
 	/*
 	 * Keep the IPv6 listener separate from the IPv4 one (no v4-mapped
@@ -181,7 +348,7 @@ int open_socket(sa_family_t family, int port, int type, char *desc)
 	}
 
 	if (port && type != SOCK_DGRAM) {
-		if (-1 == listen(sd, 20))
+		if (-1 == listen(sd, backlog))
 			WARN(errno, "Failed starting %s server", desc);
 	}
 
@@ -190,6 +357,38 @@ int open_socket(sa_family_t family, int port, int type, char *desc)
 	return sd;
 }
 
+/*
+ * Attach a classic BPF program to the SO_REUSEPORT group of @sd, with
+ * @num sockets, that picks the socket by the CPU the connection arrived
+ * on, modulo @num.  Sockets are numbered in the order they were bound,
+ * so with session hosts pinned to CPU 0..N-1 a client is served by the
+ * host on the CPU that handled its packets, instead of by flow hash.
+ */
+int reuseport_steer(int sd, int num)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter code[] = {
+		{ BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, num },
+		{ BPF_RET | BPF_A,           0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len    = NELEMS(code),
+		.filter = code,
+	};
+
+	if (num < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return setsockopt(sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 void convert_address(struct sockaddr_storage *ss, char *buf, size_t len)
 {
 	switch (ss->ss_family) {
@@ -205,65 +404,94 @@ void convert_address(struct sockaddr_storage *ss, char *buf, size_t len)
 	}
 }
 
-/* Inactivity timer, bye bye */
-static void inactivity_cb(uev_t *w, void *arg, int events)
+/*
+ * Monotonic clock, in seconds, shared by everything timing a session:
+ * the inactivity timeout, progress messages, the file cache, and the log
+ * rate limit.  It is read once per event, by clock_update() in sessions
+ * and in the callbacks of the master, all others use the cached value
+ * from clock_now().  CLOCK_MONOTONIC_COARSE is served from the vDSO, it
+ * does not go back with the wall clock and only ticks at jiffy rate,
+ * plenty for seconds.
+ */
+static time_t clock_cached;
+
+time_t clock_update(void)
 {
-	uev_ctx_t *ctx = (uev_ctx_t *)arg;
+	struct timespec ts;
 
-	INFO("Inactivity timer, exiting ...");
-	uev_exit(ctx);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	clock_cached = ts.tv_sec;
+
+	return clock_cached;
 }
 
-ctrl_t *new_session(uev_ctx_t *ctx, int sd, int *rc)
+time_t clock_now(void)
 {
-	ctrl_t *ctrl = NULL;
-	static int privs_dropped = 0;
+	if (!clock_cached)
+		return clock_update();
 
-	if (!inetd) {
-		pid_t pid = fork();
+	return clock_cached;
+}
 
-		if (pid) {
-			DBG("Created new client session as PID %d", pid);
-			*rc = pid;
-			return NULL;
-		}
+/*
+ * Transfers and commands are often shorter than a tick of the coarse
+ * clock, so they are timed with the precise one, in usec, read at start
+ * and end only.
+ */
+uint64_t clock_usec(void)
+{
+	struct timespec ts;
 
-		/*
-		 * Set process group to parent, so uftpd can call
-		 * killpg() on all of us when it exits.
-		 */
-		setpgid(0, getppid());
-		/* Create new uEv context for the child. */
-		ctx = calloc(1, sizeof(uev_ctx_t));
-		if (!ctx) {
-			ERR(errno, "Failed allocating session event context");
-			exit(1);
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-		uev_init(ctx);
-	}
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	ctrl = calloc(1, sizeof(ctrl_t));
-	if (!ctrl) {
-		ERR(errno, "Failed allocating session context");
-		goto fail;
+/*
+ * Record activity on the session.  Called first thing for every command,
+ * packet and chunk of data, so this is where the clock is updated.  The
+ * inactivity timer is not touched until it fires, see inactivity_cb().
+ */
+void session_touch(ctrl_t *ctrl)
+{
+	ctrl->active = clock_update();
+}
+
+/* Inactivity timer, bye bye, unless there was activity since it started */
+static void inactivity_cb(uev_t *w, void *arg, int events)
+{
+	ctrl_t *ctrl = (ctrl_t *)arg;
+	time_t idle;
+
+	idle = clock_update() - ctrl->active;
+	if (idle < ctrl->idle_max) {
+		uev_timer_set(w, (ctrl->idle_max - idle) * 1000, 0);
+		return;
 	}
 
-	ctrl->sd = set_nonblock(sd);
-	ctrl->ctx = ctx;
-	strlcpy(ctrl->cwd, "/", sizeof(ctrl->cwd));
+	INFO("Inactivity timer, exiting ...");
+	session_exit(ctrl);
+}
+
+/*
+ * Chroot to the FTP root and drop privileges, once per process.  Done
+ * by each forked session, or by pool workers before they are needed.
+ */
+int session_init(void)
+{
+	static int privs_dropped = 0;
 
 	/* Chroot to FTP root */
 	if (!chrooted && geteuid() == 0) {
 		if (chroot(home) || chdir("/")) {
 			ERR(errno, "Failed chrooting to FTP root, %s, aborting", home);
-			goto fail;
+			return -1;
 		}
 		chrooted = 1;
 	} else if (!chrooted) {
 		if (chdir(home)) {
 			WARN(errno, "Failed changing to FTP root, %s, aborting", home);
-			goto fail;
+			return -1;
 		}
 	}
 
@@ -288,21 +516,92 @@ ctrl_t *new_session(uev_ctx_t *ctx, int sd, int *rc)
 		 */
 		if (!do_insecure && !access(home, W_OK)) {
 			ERR(0, "FTP root %s writable, possible security violation, aborting session!", home);
-			goto fail;
+			return -1;
 		}
 
 		/* On failure, we tried at least.  Only warn once. */
 		privs_dropped = 1;
 	}
 
+	return 0;
+}
+
+ctrl_t *new_session(uev_ctx_t *ctx, int sd, int isftp, int *rc)
+{
+	int shared = do_single && forked && isftp;
+	ctrl_t *ctrl = NULL;
+
+	if (!inetd && !forked) {
+		pid_t pid = fork();
+
+		if (pid) {
+			DBG("Created new client session as PID %d", pid);
+			*rc = pid;
+			return NULL;
+		}
+
+		/*
+		 * Set process group to parent, so uftpd can call
+		 * killpg() on all of us when it exits.
+		 */
+		setpgid(0, getppid());
+		/* Create new uEv context for the child. */
+		ctx = calloc(1, sizeof(uev_ctx_t));
+		if (!ctx) {
+			ERR(errno, "Failed allocating session event context");
+			exit(1);
+		}
+
+		uev_init(ctx);
+		log_init(ctx);
+	}
+
+	ctrl = calloc(1, sizeof(ctrl_t));
+	if (!ctrl) {
+		ERR(errno, "Failed allocating session context");
+		goto fail;
+	}
+
+	ctrl->sd = set_nonblock(sd);
+	ctrl->ctx = ctx;
+	ctrl->shared = shared;
+	ctrl->root_fd = -1;
+	ctrl->data_pool = -1;
+	strlcpy(ctrl->cwd, "/", sizeof(ctrl->cwd));
+
+	if (session_init())
+		goto fail;
+
+	/* Where open_path() starts, the FTP root is our cwd now */
+	ctrl->root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+	/* After dropping privileges, for MLSD perm facts */
+	ctrl->uid = getuid();
+	ctrl->gid = getgid();
+	ctrl->ngroups = getgroups(0, NULL);
+	if (ctrl->ngroups > 0) {
+		ctrl->groups = calloc(ctrl->ngroups, sizeof(gid_t));
+		if (ctrl->groups)
+			ctrl->ngroups = getgroups(ctrl->ngroups, ctrl->groups);
+	}
+	if (!ctrl->groups || ctrl->ngroups < 0)
+		ctrl->ngroups = 0;
+
 	/* Session timeout handler */
-	uev_timer_init(ctrl->ctx, &ctrl->timeout_watcher, inactivity_cb, ctrl->ctx, INACTIVITY_TIMER, 0);
+	ctrl->idle_max = isftp ? ftp_timeout : tftp_timeout;
+	session_touch(ctrl);
+	uev_timer_init(ctrl->ctx, &ctrl->timeout_watcher, inactivity_cb, ctrl, ctrl->idle_max * 1000, 0);
+	stats_session(isftp, 1);
+	PROBE3(session__start, ctrl, isftp, sd);
 
 	return ctrl;
 fail:
-	if (ctrl)
+	if (ctrl) {
+		if (ctrl->root_fd >= 0)
+			close(ctrl->root_fd);
 		free(ctrl);
-	if (!inetd) {
+	}
+	if (!inetd && !shared) {
 		free(ctx);
 
 		/*
@@ -310,8 +609,10 @@ fail:
 		 * the child; it must never fall back to the parent's accept
 		 * loop, or it becomes a rogue listener that forks ever more
 		 * sessions, leaving defunct (zombie) processes behind until
-		 * the system runs out of PIDs.  Issue #32.
+		 * the system runs out of PIDs.  Issue #32.  No atexit()
+		 * handlers, the log is ours to flush.
 		 */
+		log_exit();
 		_exit(1);
 	}
 	*rc = -1;
@@ -326,31 +627,118 @@ int del_session(ctrl_t *ctrl, int isftp)
 	if (!ctrl)
 		return -1;
 
+	/* Transfer still in progress, and lines not yet written */
+	xferlog_done(ctrl, 0);
+	xferlog_flush();
+	stats_session(isftp, -1);
+	PROBE2(session__done, ctrl, isftp);
+
 	if (isftp && ctrl->sd > 0) {
 		shutdown(ctrl->sd, SHUT_RDWR);
 		close(ctrl->sd);
 	}
 
-	if (ctrl->data_listen_sd > 0) {
-		shutdown(ctrl->data_listen_sd, SHUT_RDWR);
-		close(ctrl->data_listen_sd);
-	}
+	if (isftp)
+		pasv_close(ctrl);
 
 	if (ctrl->data_sd > 0) {
 		shutdown(ctrl->data_sd, SHUT_RDWR);
 		close(ctrl->data_sd);
 	}
 
+	/* Any transfer or listing in progress, matters with shared sessions */
+	if (isftp) {
+		walk_free(ctrl);
+		dir_close(ctrl->d);
+		free(ctrl->ls);
+		free(ctrl->pdir);
+		dir_close(ctrl->stat_d);
+		free(ctrl->stat_dir);
+		free(ctrl->obuf);
+		free(ctrl->blkout);
+	}
+	if (ctrl->fp)
+		fclose(ctrl->fp);
+	free(ctrl->file);
+
+	fcache_flush(ctrl);
+	if (ctrl->root_fd >= 0)
+		close(ctrl->root_fd);
+
 	if (ctrl->buf)
 		free(ctrl->buf);
+	if (ctrl->rbuf)
+		free(ctrl->rbuf);
+	if (ctrl->groups)
+		free(ctrl->groups);
 
-	if (!inetd && ctrl->ctx)
+	if (!inetd && !ctrl->shared && ctrl->ctx)
 		free(ctrl->ctx);
 	free(ctrl);
 
 	return 0;
 }
 
+/*
+ * Free sessions ended in an earlier round of the event loop.  Events
+ * already returned by epoll in the round a session ended may still
+ * refer to its watchers, so it is freed no earlier than the next one.
+ */
+static void reaper_cb(uev_t *w, void *arg, int events)
+{
+	while (dead) {
+		ctrl_t *ctrl = dead;
+
+		dead = ctrl->next;
+		del_session(ctrl, 1);
+	}
+
+	dead  = dying;
+	dying = NULL;
+	if (dead)
+		uev_event_post(w);
+}
+
+/*
+ * End session, from any of its callbacks.  A session with an event loop
+ * of its own, i.e. a forked one, just leaves its loop and the caller of
+ * uev_run() cleans up.  Sessions sharing the loop stop their watchers
+ * and are freed later, by reaper_cb().
+ */
+void session_exit(ctrl_t *ctrl)
+{
+	if (!ctrl->shared) {
+		/* No more commands, even if already received */
+		uev_io_stop(&ctrl->io_watcher);
+		uev_exit(ctrl->ctx);
+		return;
+	}
+
+	if (ctrl->sd < 0)
+		return;		/* Already ending */
+
+	if (!reaper.ctx && uev_event_init(ctrl->ctx, &reaper, reaper_cb, NULL)) {
+		ERR(errno, "Failed setting up session reaper");
+		reaper.ctx = NULL;
+	}
+
+	uev_io_stop(&ctrl->io_watcher);
+	uev_io_stop(&ctrl->data_watcher);
+	uev_timer_stop(&ctrl->timeout_watcher);
+	close(ctrl->timeout_watcher.fd);
+
+	/* Close connections now, only the memory must wait */
+	if (ctrl->sd > 0) {
+		shutdown(ctrl->sd, SHUT_RDWR);
+		close(ctrl->sd);
+		ctrl->sd = -1;
+	}
+
+	ctrl->next = dying;
+	dying = ctrl;
+	uev_event_post(&reaper);
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
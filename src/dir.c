@@ -0,0 +1,219 @@
+/* Directory reader for LIST, NLST and MLSD
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uftpd.h"
+#include <sys/syscall.h>
+
+/* Batch size for getdents64(), also the arena growth step */
+#define DIR_BUFSZ  32768
+
+/* Record layout returned by getdents64(), not exported by all C libraries */
+struct dirent64_rec {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
+static ssize_t dir_fill(dir_t *dir)
+{
+	ssize_t len;
+
+	len = syscall(SYS_getdents64, dir->fd, dir->buf, dir->bufsz);
+	if (len < 0) {
+		int err = errno;
+
+		ERR(err, "Failed reading directory");
+		errno = err;
+		return -1;
+	}
+
+	dir->len = len;
+	dir->pos = 0;
+
+	return len;
+}
+
+static int dir_cmp(const void *a, const void *b)
+{
+	return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Sorted mode: collect all names in an arena, each preceded by its
+ * d_type, then sort an array of pointers into it, like alphasort().
+ * The arena is one allocation instead of one per entry, as scandir().
+ */
+static int dir_load(dir_t *dir)
+{
+	size_t arenasz = 0, arenalen = 0, max = 0;
+	char *arena = NULL;
+	size_t *offset = NULL;
+	ssize_t rc;
+	int i, err;
+
+	while ((rc = dir_fill(dir)) > 0) {
+		while (dir->pos < dir->len) {
+			struct dirent64_rec *de = (struct dirent64_rec *)&dir->buf[dir->pos];
+			size_t len = strlen(de->d_name) + 2;
+
+			dir->pos += de->d_reclen;
+
+			if (arenalen + len > arenasz) {
+				char *ptr;
+
+				ptr = realloc(arena, arenasz + DIR_BUFSZ);
+				if (!ptr)
+					goto fail;
+				arena    = ptr;
+				arenasz += DIR_BUFSZ;
+			}
+
+			if ((size_t)dir->num == max) {
+				size_t *ptr;
+
+				ptr = realloc(offset, (max + 256) * sizeof(size_t));
+				if (!ptr)
+					goto fail;
+				offset = ptr;
+				max   += 256;
+			}
+
+			arena[arenalen] = de->d_type;
+			memcpy(&arena[arenalen + 1], de->d_name, len - 1);
+			offset[dir->num++] = arenalen + 1;
+			arenalen += len;
+		}
+	}
+
+	/* Never a partial listing, a read error fails it all */
+	if (rc < 0)
+		goto error;
+
+	/* Reuse the offset array for the final pointers into the arena */
+	dir->names = (char **)offset;
+	for (i = 0; i < dir->num; i++)
+		dir->names[i] = &arena[offset[i]];
+	qsort(dir->names, dir->num, sizeof(char *), dir_cmp);
+
+	free(dir->buf);
+	dir->buf = arena;
+
+	return 0;
+fail:
+	ERR(errno, "Failed allocating memory for directory listing");
+error:
+	err = errno;
+	free(offset);
+	free(arena);
+	errno = err;
+
+	return -1;
+}
+
+/*
+ * Open directory @path for listing.  In streaming mode nothing is read
+ * until dir_read(), so time to first entry and memory use is the same
+ * regardless of directory size.  Sorted mode reads everything first.
+ */
+dir_t *dir_open(char *path, int sorted)
+{
+	dir_t *dir;
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return NULL;
+
+	dir->fd     = -1;
+	dir->sorted = sorted;
+	dir->bufsz  = DIR_BUFSZ;
+	dir->buf    = malloc(dir->bufsz);
+	if (!dir->buf)
+		goto fail;
+
+	dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir->fd < 0)
+		goto fail;
+
+	if (sorted && dir_load(dir))
+		goto fail;
+
+	return dir;
+fail:
+	dir_close(dir);
+	return NULL;
+}
+
+/*
+ * Returns next entry name, or NULL when done, type of entry in dir->type.
+ * On a read error also NULL, with dir->err set, the listing is partial.
+ */
+char *dir_read(dir_t *dir)
+{
+	struct dirent64_rec *de;
+	char *name;
+	ssize_t rc;
+
+	if (dir->sorted) {
+		if (dir->i >= dir->num)
+			return NULL;
+
+		name = dir->names[dir->i++];
+		dir->type = name[-1];
+
+		return name;
+	}
+
+	if (dir->pos >= dir->len) {
+		rc = dir_fill(dir);
+		if (rc <= 0) {
+			if (rc < 0)
+				dir->err = errno;
+			return NULL;
+		}
+	}
+
+	de = (struct dirent64_rec *)&dir->buf[dir->pos];
+	dir->pos += de->d_reclen;
+	dir->type = de->d_type;
+
+	return de->d_name;
+}
+
+void dir_close(dir_t *dir)
+{
+	int err = errno;
+
+	if (!dir)
+		return;
+
+	if (dir->fd >= 0)
+		close(dir->fd);
+	free(dir->names);
+	free(dir->buf);
+	free(dir);
+
+	errno = err;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
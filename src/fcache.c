@@ -0,0 +1,183 @@
+/* Per-session cache of files looked up by SIZE, MDTM and RETR
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uftpd.h"
+
+/*
+ * Scripted clients often send SIZE, MDTM and RETR for the same file back
+ * to back.  Instead of resolving the path for each, the first one keeps
+ * the file open for a little while.  A hit costs one fstat(), which also
+ * returns the current size and mtime, so only a file replaced by another
+ * process, e.g. renamed over, can be missed, and only for FCACHE_TTL sec.
+ * Any change made by the session itself flushes the cache.
+ */
+
+static void drop(fcache_t *fc)
+{
+	if (!fc->key)
+		return;
+
+	close(fc->fd);
+	free(fc->key);
+	fc->key = NULL;
+}
+
+void fcache_flush(ctrl_t *ctrl)
+{
+	for (size_t i = 0; i < NELEMS(ctrl->fcache); i++)
+		drop(&ctrl->fcache[i]);
+}
+
+/* Same path may refer to another file after CWD, so key on both */
+static int key(ctrl_t *ctrl, char *path, char *buf, size_t len)
+{
+	return (size_t)snprintf(buf, len, "%s\n%s", ctrl->cwd, path ?: "") >= len;
+}
+
+static fcache_t *lookup(ctrl_t *ctrl, char *key, struct stat *st)
+{
+	time_t now = clock_now();
+
+	for (size_t i = 0; i < NELEMS(ctrl->fcache); i++) {
+		fcache_t *fc = &ctrl->fcache[i];
+
+		if (!fc->key || strcmp(fc->key, key))
+			continue;
+
+		if (now - fc->when > FCACHE_TTL || fstat(fc->fd, st) || !st->st_nlink) {
+			drop(fc);
+			return NULL;
+		}
+
+		return fc;
+	}
+
+	return NULL;
+}
+
+static int lookup_open(ctrl_t *ctrl, char *path, struct stat *st, int *readable)
+{
+	int fd;
+
+	*readable = 1;
+	fd = open_path(ctrl, path, O_RDONLY | O_NONBLOCK | O_NOCTTY, 0);
+	if (fd < 0 && EACCES == errno) {
+		*readable = 0;
+		fd = open_path(ctrl, path, O_PATH, 0);
+	}
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, st)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Look up @path, returns a descriptor owned by the cache, do not close
+ * it, or -1 on error.  It is only readable if @readable is set.
+ */
+int fcache_stat(ctrl_t *ctrl, char *path, struct stat *st, int *readable)
+{
+	char buf[sizeof(ctrl->cwd) + PATH_MAX];
+	fcache_t *fc, *slot = NULL;
+	int fd;
+
+	if (key(ctrl, path, buf, sizeof(buf))) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fc = lookup(ctrl, buf, st);
+	if (fc) {
+		DBG("Found %s in file cache", path ?: "");
+		*readable = fc->readable;
+		return fc->fd;
+	}
+
+	fd = lookup_open(ctrl, path, st, readable);
+	if (fd < 0)
+		return -1;
+
+	/* Free slot, or the oldest */
+	for (size_t i = 0; i < NELEMS(ctrl->fcache); i++) {
+		fc = &ctrl->fcache[i];
+		if (!fc->key) {
+			slot = fc;
+			break;
+		}
+		if (!slot || fc->when < slot->when)
+			slot = fc;
+	}
+
+	drop(slot);
+	slot->key = strdup(buf);
+	if (!slot->key) {
+		close(fd);
+		return -1;
+	}
+	slot->fd       = fd;
+	slot->readable = *readable;
+	slot->when     = clock_now();
+
+	return fd;
+}
+
+/* Like fcache_stat() but the caller takes over the, readable, descriptor */
+int fcache_take(ctrl_t *ctrl, char *path, struct stat *st)
+{
+	char buf[sizeof(ctrl->cwd) + PATH_MAX];
+	int readable;
+	fcache_t *fc;
+	int fd;
+
+	if (!key(ctrl, path, buf, sizeof(buf))) {
+		fc = lookup(ctrl, buf, st);
+		if (fc && fc->readable) {
+			DBG("Found %s in file cache", path ?: "");
+			fd = fc->fd;
+			free(fc->key);
+			fc->key = NULL;
+
+			/* SIZE in ASCII mode may have read it */
+			lseek(fd, 0, SEEK_SET);
+
+			return fd;
+		}
+		if (fc)
+			drop(fc);
+	}
+
+	fd = lookup_open(ctrl, path, st, &readable);
+	if (fd >= 0 && !readable) {
+		close(fd);
+		errno = EACCES;
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
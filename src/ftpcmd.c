@@ -18,6 +18,7 @@
 #include "uftpd.h"
 #include <ctype.h>
 #include <arpa/ftp.h>
+#include <sys/statvfs.h>
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
@@ -27,6 +28,17 @@
 #define LISTMODE_MLST 2
 #define LISTMODE_MLSD 3
 
+/* MODE B block header descriptor, RFC 959 */
+#define BLOCK_EOR     0x80
+#define BLOCK_EOF     0x40
+#define BLOCK_ERRORS  0x20
+#define BLOCK_RESTART 0x10
+#define BLOCK_HDRSZ   3
+
+/* Multiplicative hash of command words, see hash_commands() */
+#define CMD_HASH_BITS 6
+#define CMD_HASH_MULT 0x00125d71
+
 typedef struct {
 	char *command;
 	void (*cb)(ctrl_t *ctr, char *arg);
@@ -53,92 +65,125 @@ static int is_cont(char *msg)
 	return 0;
 }
 
-static int send_msg(int sd, char *msg)
+/* Reply code of the last line in @msg, if it ends a reply, otherwise 0 */
+static int reply_code(char *msg, size_t len)
 {
-	int n = 0;
-	int l;
+	char *line = msg;
 
-	if (!msg) {
-	err:
-		ERR(EINVAL, "Missing argument to send_msg()");
-		return 1;
+	for (size_t i = 0; i + 1 < len; i++) {
+		if (msg[i] == '\n')
+			line = &msg[i + 1];
 	}
 
-	l = strlen(msg);
-	if (l <= 0)
-		goto err;
+	for (int i = 0; i < 3; i++) {
+		if (!isdigit((unsigned char)line[i]))
+			return 0;
+	}
+	if (line[3] != ' ')
+		return 0;
 
-	while (n < l) {
-		int result = send(sd, msg + n, l, 0);
+	return atoi(line);
+}
 
-		if (result < 0) {
-			ERR(errno, "Failed sending message to client");
+/* Queue @len bytes of @msg, sent when the control connection is writable */
+static int reply_queue(ctrl_t *ctrl, char *msg, size_t len)
+{
+	if (ctrl->olen + len > ctrl->osize) {
+		char *ptr;
+
+		ptr = realloc(ctrl->obuf, ctrl->olen + len);
+		if (!ptr) {
+			ERR(errno, "Failed queuing reply to %s", ctrl->clientaddr);
 			return 1;
 		}
-
-		n += result;
+		ctrl->obuf  = ptr;
+		ctrl->osize = ctrl->olen + len;
 	}
 
-	DBG("Sent: %s%s", is_cont(msg) ? "\n" : "", msg);
+	memcpy(&ctrl->obuf[ctrl->olen], msg, len);
+	ctrl->olen += len;
+
+	if (uev_io_active(&ctrl->io_watcher))
+		uev_io_set(&ctrl->io_watcher, ctrl->sd, UEV_READ | UEV_WRITE);
 
 	return 0;
 }
 
-/*
- * Receive message from client, split into command and argument
- */
-static int recv_msg(int sd, char *msg, size_t len, char **cmd, char **argument)
+/* Send what is queued, as much as the control connection takes */
+static int reply_flush(ctrl_t *ctrl)
 {
-	char *ptr;
-	ssize_t bytes;
-	uint8_t *raw = (uint8_t *)msg;
+	ssize_t n;
 
-	/* Clear for every new command. */
-	memset(msg, 0, len);
+	if (!ctrl->olen)
+		return 0;
 
-	/* Save one byte (-1) for NUL termination */
-	bytes = recv(sd, msg, len - 1, 0);
-	if (bytes < 0) {
-		if (EINTR == errno)
-			return 1;
+	n = send(ctrl->sd, ctrl->obuf, ctrl->olen, 0);
+	if (n < 0) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+			return 0;
 
-		if (ECONNRESET == errno)
-			DBG("Connection reset by client.");
-		else
-			ERR(errno, "Failed reading client command");
+		ERR(errno, "Failed sending message to client");
 		return 1;
 	}
 
-	if (!bytes) {
-		INFO("Client disconnected.");
-		return 1;
-	}
+	session_touch(ctrl);
+	ctrl->olen -= n;
+	memmove(ctrl->obuf, &ctrl->obuf[n], ctrl->olen);
+
+	return 0;
+}
 
-	if (raw[0] == 0xff) {
-		char tmp[4];
-		char buf[20] = { 0 };
-		int i;
+/*
+ * Send reply, or part of one, @msg to the client.  What does not fit in
+ * the socket buffer is queued and sent from read_client_command(), we
+ * never wait for the client.  No commands are run until the queue has
+ * been sent, see process(), so it holds at most the replies of one.
+ */
+static int send_msg(ctrl_t *ctrl, char *msg)
+{
+	ssize_t n = 0;
+	size_t len;
+	int code;
 
-		i = recv(sd, &msg[bytes], len - bytes - 1, MSG_OOB | MSG_DONTWAIT);
-		if (i > 0)
-			bytes += i;
+	if (!msg || !(len = strlen(msg))) {
+		ERR(EINVAL, "Missing argument to send_msg()");
+		return 1;
+	}
 
-		for (i = 0; i < bytes; i++) {
-			snprintf(tmp, sizeof(tmp), "%2X%s", raw[i], i + 1 < bytes ? " " : "");
-			strlcat(buf, tmp, sizeof(buf));
+	if (!ctrl->olen) {
+		n = send(ctrl->sd, msg, len, 0);
+		if (n < 0) {
+			if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+				ERR(errno, "Failed sending message to client");
+				return 1;
+			}
+			n = 0;
 		}
+	}
 
-		strlcpy(msg, buf, len);
-		*cmd      = msg;
-		*argument = NULL;
+	if ((size_t)n < len && reply_queue(ctrl, &msg[n], len - n))
+		return 1;
 
-		DBG("Recv: [%s], %zd bytes", msg, bytes);
+	/* Final reply of a command, preliminary 1xx ones are followed by one */
+	code = reply_code(msg, len);
+	if (code >= 200)
+		stats_reply(code);
+	DBG("Sent: %s%s", is_cont(msg) ? "\n" : "", msg);
 
-		return 0;
-	}
+	return 0;
+}
 
-	/* NUL terminate for strpbrk() */
-	msg[bytes] = 0;
+/*
+ * Split command line in @msg, without CRLF, into command and argument.
+ * Any telnet IAC sequence in front, e.g. IP and Synch before an ABOR,
+ * is skipped.
+ */
+static void parse_msg(char *msg, char **cmd, char **argument)
+{
+	char *ptr;
+
+	while ((uint8_t)*msg >= 0xf0)
+		msg++;
 
 	*cmd = msg;
 	ptr  = strpbrk(msg, " ");
@@ -148,29 +193,30 @@ static int recv_msg(int sd, char *msg, size_t len, char **cmd, char **argument)
 		*argument = ptr;
 	} else {
 		*argument = NULL;
-		ptr = msg;
 	}
 
-	ptr = strpbrk(ptr, "\r\n");
-	if (ptr)
-		*ptr = 0;
-
 	/* Convert command to std ftp upper case, issue #18 */
 	for (ptr = msg; *ptr; ++ptr) *ptr = toupper(*ptr);
 
 	DBG("Recv: %s %s", *cmd, *argument ?: "");
+}
 
-	return 0;
+/* Nothing to accept after all, e.g., the client gave up, keep waiting */
+static int again(int err)
+{
+	return EAGAIN == err || EWOULDBLOCK == err || ECONNABORTED == err || EINTR == err;
 }
 
 static int open_data_connection(ctrl_t *ctrl)
 {
+	const int const_int_1 = 1;
 	inet_addr_t sin = { 0 };
 	socklen_t len;
 
 	/* Previous PORT/EPRT command from client */
 	if (ctrl->data_address[0]) {
 		sa_family_t family = ctrl->data_family ? ctrl->data_family : AF_INET;
+		int syncnt = CONNECT_SYNCNT;
 		int rc;
 
 		ctrl->data_sd = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
@@ -192,6 +238,11 @@ static int open_data_connection(ctrl_t *ctrl)
 			s4->sin_port = htons(ctrl->data_port);
 		}
 
+		/* Give up after a few SYN retries, instead of the system default */
+		setsockopt(ctrl->data_sd, IPPROTO_TCP, TCP_SYNCNT, &syncnt, sizeof(syncnt));
+		if (ctrl->mode == MODE_B)
+			setsockopt(ctrl->data_sd, IPPROTO_TCP, TCP_NODELAY, &const_int_1, sizeof(const_int_1));
+
 		rc = connect(ctrl->data_sd, (struct sockaddr *)&sin, inet_len(&sin));
 		if (rc == -1 && EINPROGRESS != errno) {
 			ERR(errno, "Failed connecting data socket to client");
@@ -201,38 +252,55 @@ static int open_data_connection(ctrl_t *ctrl)
 			return -1;
 		}
 
-		DBG("Connected successfully to client's previously requested address:PORT %s:%d",
+		DBG("Connecting to client's previously requested address:PORT %s:%d",
 		    ctrl->data_address, ctrl->data_port);
 		return 0;
 	}
 
 	/* Previous PASV command, accept connect from client */
 	if (ctrl->data_listen_sd > 0) {
-		const int const_int_1 = 1;
 		char client_ip[INET_ADDRSTR_LEN];
-		int retries = 3;
 
-	retry:
 		len = sizeof(sin);
-		ctrl->data_sd = accept(ctrl->data_listen_sd, (struct sockaddr *)&sin, &len);
+		ctrl->data_sd = accept4(ctrl->data_listen_sd, (struct sockaddr *)&sin, &len,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
 		if (-1 == ctrl->data_sd) {
-			if (EAGAIN == errno && --retries) {
-				sleep(1);
-				goto retry;
-			}
-
-			ERR(errno, "Failed accepting connection from client");
+			if (!again(errno))
+				ERR(errno, "Failed accepting connection from client");
 			return -1;
 		}
 
+		/*
+		 * Pool sockets listen on all addresses, only accept the data
+		 * connection on the address the control connection arrived
+		 * on, the one advertised in the 227 reply, like a socket of
+		 * our own bound to it would.
+		 */
+		if (ctrl->data_pool >= 0) {
+			inet_addr_t local;
+
+			len = sizeof(local);
+			if (getsockname(ctrl->data_sd, (struct sockaddr *)&local, &len) ||
+			    !inet_addr_equal(&local, &ctrl->server_sa)) {
+				inet_ntop2(&sin, client_ip, sizeof(client_ip));
+				WARN(0, "Dropping PASV data connection from %s, wrong local address", client_ip);
+				close(ctrl->data_sd);
+				ctrl->data_sd = -1;
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+
 		setsockopt(ctrl->data_sd, SOL_SOCKET, SO_KEEPALIVE, &const_int_1, sizeof(const_int_1));
-		set_nonblock(ctrl->data_sd);
+
+		/* MODE B, the small end of file block must not wait for an ACK */
+		if (ctrl->mode == MODE_B)
+			setsockopt(ctrl->data_sd, IPPROTO_TCP, TCP_NODELAY, &const_int_1, sizeof(const_int_1));
 
 		inet_ntop2(&sin, client_ip, sizeof(client_ip));
 		DBG("Client PASV data connection from %s:%d", client_ip, inet_port(&sin));
 
-		close(ctrl->data_listen_sd);
-		ctrl->data_listen_sd = -1;
+		pasv_close(ctrl);
 	}
 
 	return 0;
@@ -246,9 +314,7 @@ static int close_data_connection(ctrl_t *ctrl)
 
 	/* PASV server listening socket */
 	if (ctrl->data_listen_sd > 0) {
-		shutdown(ctrl->data_listen_sd, SHUT_RDWR);
-		close(ctrl->data_listen_sd);
-		ctrl->data_listen_sd = -1;
+		pasv_close(ctrl);
 		ret++;
 	}
 
@@ -270,6 +336,13 @@ static int close_data_connection(ctrl_t *ctrl)
 	return ret;
 }
 
+/* Watch data connection, or PASV socket, may be armed by earlier command */
+static void data_watch(ctrl_t *ctrl, uev_cb_t *cb, int fd, int events)
+{
+	uev_io_stop(&ctrl->data_watcher);
+	uev_io_init(ctrl->ctx, &ctrl->data_watcher, cb, ctrl, fd, events);
+}
+
 static int check_user_pass(ctrl_t *ctrl)
 {
 	if (!ctrl->name[0])
@@ -281,17 +354,16 @@ static int check_user_pass(ctrl_t *ctrl)
 	return 0;
 }
 
-static int do_abort(ctrl_t *ctrl)
+/* Free what is left of the current transfer, or listing */
+static void transfer_free(ctrl_t *ctrl)
 {
+	/* Not already logged by do_complete(), so aborted */
+	xferlog_done(ctrl, 0);
+
 	if (ctrl->d || ctrl->d_num) {
 		uev_io_stop(&ctrl->data_watcher);
-		if (ctrl->d_num > 0) {
-			int i;
-
-			for (i = 0; i < ctrl->d_num; i++)
-				free(ctrl->d[i]);
-			free(ctrl->d);
-		}
+		dir_close(ctrl->d);
+		walk_free(ctrl);
 		ctrl->d_num = 0;
 		ctrl->d = NULL;
 		ctrl->i = 0;
@@ -307,6 +379,16 @@ static int do_abort(ctrl_t *ctrl)
 		ctrl->file = NULL;
 	}
 
+	if (ctrl->ls) {
+		free(ctrl->ls);
+		ctrl->ls = NULL;
+	}
+
+	if (ctrl->pdir) {
+		free(ctrl->pdir);
+		ctrl->pdir = NULL;
+	}
+
 	if (ctrl->fp) {
 		fclose(ctrl->fp);
 		ctrl->fp = NULL;
@@ -314,17 +396,210 @@ static int do_abort(ctrl_t *ctrl)
 
 	ctrl->pending = PENDING_NONE;
 	ctrl->offset = 0;
+	ctrl->blkhdr_len = 0;
+	ctrl->blkleft = 0;
+	free(ctrl->blkout);
+	ctrl->blkout = NULL;
+	ctrl->blkout_len = 0;
+
+	/* Commands held back during the transfer, see process() */
+	if (ctrl->rlen && uev_io_active(&ctrl->io_watcher))
+		uev_io_set(&ctrl->io_watcher, ctrl->sd, UEV_READ | UEV_WRITE);
+}
+
+static int do_abort(ctrl_t *ctrl)
+{
+	transfer_free(ctrl);
 
 	return close_data_connection(ctrl);
 }
 
+/* MODE B, keep the rest of a block, from byte @off of its header, to send later */
+static int block_queue(ctrl_t *ctrl, uint8_t *hdr, char *buf, size_t len, size_t off)
+{
+	size_t rest = BLOCK_HDRSZ + len - off;
+	char *ptr;
+
+	ptr = realloc(ctrl->blkout, ctrl->blkout_len + rest);
+	if (!ptr)
+		return -1;
+
+	ctrl->blkout = ptr;
+	ptr += ctrl->blkout_len;
+	ctrl->blkout_len += rest;
+
+	if (off < BLOCK_HDRSZ) {
+		memcpy(ptr, &hdr[off], BLOCK_HDRSZ - off);
+		ptr += BLOCK_HDRSZ - off;
+		off = BLOCK_HDRSZ;
+	}
+	if (len)
+		memcpy(ptr, &buf[off - BLOCK_HDRSZ], len - (off - BLOCK_HDRSZ));
+
+	return 0;
+}
+
+/*
+ * Send on the data connection.  In MODE B each call is one block, with
+ * @flags in its header, blocks cannot be split, so what does not fit in
+ * the socket buffer is queued and sent by data_flush() from the data
+ * watcher, we never wait for the client.  In stream mode it is a plain
+ * send(), which may be partial.
+ */
+static ssize_t data_send(ctrl_t *ctrl, char *buf, size_t len, int flags)
+{
+	uint8_t hdr[BLOCK_HDRSZ] = { flags, len >> 8, len & 0xff };
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = buf, .iov_len = len         },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	ssize_t n = 0;
+
+	if (ctrl->mode != MODE_B)
+		return send(ctrl->data_sd, buf, len, 0);
+
+	/* Keep the order, behind what is already queued */
+	if (!ctrl->blkout_len) {
+		n = sendmsg(ctrl->data_sd, &msg, 0);
+		if (n < 0) {
+			if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+				return -1;
+			n = 0;
+		}
+	}
+
+	if ((size_t)n < BLOCK_HDRSZ + len && block_queue(ctrl, hdr, buf, len, n))
+		return -1;
+
+	return len;
+}
+
+/*
+ * MODE B, send what is queued by data_send().  Returns 0 when all of it
+ * is sent, 1 while some is left for the next UEV_WRITE, or -1 on error.
+ */
+static int data_flush(ctrl_t *ctrl)
+{
+	ssize_t n;
+
+	if (!ctrl->blkout_len)
+		return 0;
+
+	n = send(ctrl->data_sd, ctrl->blkout, ctrl->blkout_len, 0);
+	if (n < 0) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+			return 1;
+		return -1;
+	}
+
+	session_touch(ctrl);
+	ctrl->blkout_len -= n;
+	memmove(ctrl->blkout, &ctrl->blkout[n], ctrl->blkout_len);
+
+	return ctrl->blkout_len > 0;
+}
+
+/* MODE B, bytes to recv() next: rest of a block header, or its data */
+static size_t block_want(ctrl_t *ctrl, size_t len)
+{
+	if (ctrl->blkhdr_len < BLOCK_HDRSZ)
+		return BLOCK_HDRSZ - ctrl->blkhdr_len;
+
+	return MIN(ctrl->blkleft, len);
+}
+
+/*
+ * MODE B, parse @len bytes received as asked by block_want().  Returns
+ * the number of file data bytes in them, and sets @eof after the block
+ * marked as the end of the file.  Restart markers are skipped.
+ */
+static size_t block_recv(ctrl_t *ctrl, char *buf, size_t len, int *eof)
+{
+	if (ctrl->blkhdr_len < BLOCK_HDRSZ) {
+		memcpy(&ctrl->blkhdr[ctrl->blkhdr_len], buf, len);
+		ctrl->blkhdr_len += len;
+		if (ctrl->blkhdr_len < BLOCK_HDRSZ)
+			return 0;
+
+		ctrl->blkleft = ctrl->blkhdr[1] << 8 | ctrl->blkhdr[2];
+		len = 0;
+	} else {
+		ctrl->blkleft -= len;
+	}
+
+	if (!ctrl->blkleft) {
+		*eof = ctrl->blkhdr[0] & BLOCK_EOF;
+		ctrl->blkhdr_len = 0;
+	}
+
+	if (ctrl->blkhdr[0] & BLOCK_RESTART)
+		return 0;
+
+	return len;
+}
+
+static void do_EOF(uev_t *w, void *arg, int events);
+
+/*
+ * Transfer done.  In MODE B the end of file is marked by an empty block
+ * with EOF set, @send_eof for downloads, and the data connection is kept
+ * open for the next transfer.  The reply waits for the blocks still
+ * queued to be sent, see do_EOF().  In stream mode closing it marks the
+ * end.
+ */
+static void do_complete(ctrl_t *ctrl, int send_eof)
+{
+	if (ctrl->mode == MODE_B && ctrl->data_sd > 0) {
+		int rc;
+
+		if (send_eof && -1 == data_send(ctrl, NULL, 0, BLOCK_EOF))
+			rc = -1;
+		else
+			rc = data_flush(ctrl);
+		if (rc < 0) {
+			ERR(errno, "Failed sending end of file to client");
+			do_abort(ctrl);
+			send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
+			return;
+		}
+		if (rc > 0) {
+			data_watch(ctrl, do_EOF, ctrl->data_sd, UEV_WRITE);
+			return;
+		}
+
+		uev_io_stop(&ctrl->data_watcher);
+		xferlog_done(ctrl, 1);
+		transfer_free(ctrl);
+		send_msg(ctrl, "250 Transfer complete, data connection kept open.\r\n");
+		return;
+	}
+
+	xferlog_done(ctrl, 1);
+	do_abort(ctrl);
+	send_msg(ctrl, "226 Transfer complete.\r\n");
+}
+
+/* MODE B, room for the rest of the last blocks of a download */
+static void do_EOF(uev_t *w, void *arg, int events)
+{
+	ctrl_t *ctrl = (ctrl_t *)arg;
+
+	if (UEV_ERROR == events || UEV_HUP == events) {
+		uev_io_start(w);
+		return;
+	}
+
+	do_complete(ctrl, 0);
+}
+
 static void handle_ABOR(ctrl_t *ctrl, char *arg)
 {
 	DBG("Aborting any current transfer ...");
 	if (do_abort(ctrl))
-		send_msg(ctrl->sd, "426 Connection closed; transfer aborted.\r\n");
+		send_msg(ctrl, "426 Connection closed; transfer aborted.\r\n");
 
-	send_msg(ctrl->sd, "226 Closing data connection.\r\n");
+	send_msg(ctrl, "226 Closing data connection.\r\n");
 }
 
 static void handle_USER(ctrl_t *ctrl, char *name)
@@ -338,43 +613,43 @@ static void handle_USER(ctrl_t *ctrl, char *name)
 		strlcpy(ctrl->name, name, sizeof(ctrl->name));
 		if (check_user_pass(ctrl) == 1) {
 			INFO("Guest logged in from %s", ctrl->clientaddr);
-			send_msg(ctrl->sd, "230 Guest login OK, access restrictions apply.\r\n");
+			send_msg(ctrl, "230 Guest login OK, access restrictions apply.\r\n");
 		} else {
-			send_msg(ctrl->sd, "331 Login OK, please enter password.\r\n");
+			send_msg(ctrl, "331 Login OK, please enter password.\r\n");
 		}
 	} else {
-		send_msg(ctrl->sd, "530 You must input your name.\r\n");
+		send_msg(ctrl, "530 You must input your name.\r\n");
 	}
 }
 
 static void handle_PASS(ctrl_t *ctrl, char *pass)
 {
 	if (!ctrl->name[0]) {
-		send_msg(ctrl->sd, "503 No username given.\r\n");
+		send_msg(ctrl, "503 No username given.\r\n");
 		return;
 	}
 
         if (!pass) {
-                send_msg(ctrl->sd, "503 No password given.\r\n");
+                send_msg(ctrl, "503 No password given.\r\n");
                 return;
         }
 
 	strlcpy(ctrl->pass, pass, sizeof(ctrl->pass));
 	if (check_user_pass(ctrl) < 0) {
 		LOG("User %s from %s, invalid password!", ctrl->name, ctrl->clientaddr);
-		send_msg(ctrl->sd, "530 username or password is unacceptable\r\n");
+		send_msg(ctrl, "530 username or password is unacceptable\r\n");
 		return;
 	}
 
 	INFO("User %s login from %s", ctrl->name, ctrl->clientaddr);
-	send_msg(ctrl->sd, "230 Guest login OK, access restrictions apply.\r\n");
+	send_msg(ctrl, "230 Guest login OK, access restrictions apply.\r\n");
 }
 
 static void handle_SYST(ctrl_t *ctrl, char *arg)
 {
 	char system[] = "215 UNIX Type: L8\r\n";
 
-	send_msg(ctrl->sd, system);
+	send_msg(ctrl, system);
 }
 
 static void handle_TYPE(ctrl_t *ctrl, char *argument)
@@ -395,12 +670,42 @@ static void handle_TYPE(ctrl_t *ctrl, char *argument)
 		break;
 
 	default:
-		send_msg(ctrl->sd, unknown);
+		send_msg(ctrl, unknown);
 		return;
 	}
 
 	type[16] = argument[0];
-	send_msg(ctrl->sd, type);
+	send_msg(ctrl, type);
+}
+
+static void handle_MODE(ctrl_t *ctrl, char *argument)
+{
+	char mode[24] = "200 Mode set to S.\r\n";
+	int prev = ctrl->mode;
+
+	if (!argument)
+		argument = "Z";
+
+	switch (argument[0]) {
+	case 'S':
+		ctrl->mode = MODE_S; /* Stream */
+		break;
+
+	case 'B':
+		ctrl->mode = MODE_B; /* Block */
+		break;
+
+	default:
+		send_msg(ctrl, "504 Unsupported transfer mode.\r\n");
+		return;
+	}
+
+	/* A data connection kept open is framed for the previous mode */
+	if (ctrl->mode != prev && ctrl->data_sd > 0)
+		do_abort(ctrl);
+
+	mode[16] = argument[0];
+	send_msg(ctrl, mode);
 }
 
 static void handle_PWD(ctrl_t *ctrl, char *arg)
@@ -408,11 +713,12 @@ static void handle_PWD(ctrl_t *ctrl, char *arg)
 	char buf[sizeof(ctrl->cwd) + 10];
 
 	snprintf(buf, sizeof(buf), "257 \"%s\"\r\n", ctrl->cwd);
-	send_msg(ctrl->sd, buf);
+	send_msg(ctrl, buf);
 }
 
 static void handle_CWD(ctrl_t *ctrl, char *path)
 {
+	char rpath[PATH_MAX];
 	struct stat st;
 	char *dir;
 
@@ -423,10 +729,10 @@ static void handle_CWD(ctrl_t *ctrl, char *path)
 	 * Some FTP clients, most notably Chrome, use CWD to check if an
 	 * entry is a file or directory.
 	 */
-	dir = compose_abspath(ctrl, path);
+	dir = compose_abspath(ctrl, path, rpath, sizeof(rpath));
 	if (!dir || stat(dir, &st) || !S_ISDIR(st.st_mode)) {
 		INFO("%s: CWD: invalid path to %s: %m", ctrl->clientaddr, path);
-		send_msg(ctrl->sd, "550 No such directory.\r\n");
+		send_msg(ctrl, "550 No such directory.\r\n");
 		return;
 	}
 
@@ -436,10 +742,11 @@ static void handle_CWD(ctrl_t *ctrl, char *path)
 	snprintf(ctrl->cwd, sizeof(ctrl->cwd), "%s", dir);
 	if (ctrl->cwd[0] == 0)
 		snprintf(ctrl->cwd, sizeof(ctrl->cwd), "/");
+	fcache_flush(ctrl);
 
 done:
 	DBG("New CWD: '%s'", ctrl->cwd);
-	send_msg(ctrl->sd, "250 OK\r\n");
+	send_msg(ctrl, "250 OK\r\n");
 }
 
 static void handle_CDUP(ctrl_t *ctrl, char *path)
@@ -460,7 +767,7 @@ static void handle_PORT(ctrl_t *ctrl, char *str)
 	}
 
         if (!str) {
-                send_msg(ctrl->sd, "500 No PORT specified.\r\n");
+                send_msg(ctrl, "500 No PORT specified.\r\n");
                 return;
         }
 
@@ -471,7 +778,7 @@ static void handle_PORT(ctrl_t *ctrl, char *str)
 	/* Check IPv4 address using inet_aton(), throw away converted result */
 	if (!inet_aton(addr, &(sin.sin_addr))) {
 		ERR(0, "Invalid address '%s' given to PORT command", addr);
-		send_msg(ctrl->sd, "500 Illegal PORT command.\r\n");
+		send_msg(ctrl, "500 Illegal PORT command.\r\n");
 		return;
 	}
 
@@ -480,7 +787,7 @@ static void handle_PORT(ctrl_t *ctrl, char *str)
 	ctrl->data_family = AF_INET;
 
 	DBG("Client PORT command accepted for %s:%d", ctrl->data_address, ctrl->data_port);
-	send_msg(ctrl->sd, "200 PORT command successful.\r\n");
+	send_msg(ctrl, "200 PORT command successful.\r\n");
 }
 
 /*
@@ -501,7 +808,7 @@ static void handle_EPRT(ctrl_t *ctrl, char *str)
 	}
 
 	if (!str || !str[0]) {
-		send_msg(ctrl->sd, "500 No EPRT specified.\r\n");
+		send_msg(ctrl, "500 No EPRT specified.\r\n");
 		return;
 	}
 
@@ -515,7 +822,7 @@ static void handle_EPRT(ctrl_t *ctrl, char *str)
 	addr  = strsep(&sp, delim);
 	port  = strsep(&sp, delim);
 	if (!proto || !addr || !port) {
-		send_msg(ctrl->sd, "501 Illegal EPRT command.\r\n");
+		send_msg(ctrl, "501 Illegal EPRT command.\r\n");
 		return;
 	}
 
@@ -524,7 +831,7 @@ static void handle_EPRT(ctrl_t *ctrl, char *str)
 	else if (!strcmp(proto, "2"))
 		family = AF_INET6;
 	else {
-		send_msg(ctrl->sd, "522 Network protocol not supported, use (1,2)\r\n");
+		send_msg(ctrl, "522 Network protocol not supported, use (1,2)\r\n");
 		return;
 	}
 
@@ -533,7 +840,7 @@ static void handle_EPRT(ctrl_t *ctrl, char *str)
 	if (inet_pton(family, addr, family == AF_INET6
 		      ? (void *)&((struct sockaddr_in6 *)&sa)->sin6_addr
 		      : (void *)&((struct sockaddr_in *)&sa)->sin_addr) != 1) {
-		send_msg(ctrl->sd, "501 Illegal EPRT command.\r\n");
+		send_msg(ctrl, "501 Illegal EPRT command.\r\n");
 		return;
 	}
 
@@ -542,14 +849,12 @@ static void handle_EPRT(ctrl_t *ctrl, char *str)
 	ctrl->data_family = family;
 
 	DBG("Client EPRT command accepted for %s:%d", ctrl->data_address, ctrl->data_port);
-	send_msg(ctrl->sd, "200 EPRT command successful.\r\n");
+	send_msg(ctrl, "200 EPRT command successful.\r\n");
 }
 
-static char *mode_to_str(mode_t m)
+static char *mode_to_str(mode_t m, char *str, size_t len)
 {
-	static char str[11];
-
-	snprintf(str, sizeof(str), "%c%c%c%c%c%c%c%c%c%c",
+	snprintf(str, len, "%c%c%c%c%c%c%c%c%c%c",
 		 S_ISDIR(m)    ? 'd' : '-',
 		 (m & S_IRUSR) ? 'r' : '-',
 		 (m & S_IWUSR) ? 'w' : '-',
@@ -564,23 +869,63 @@ static char *mode_to_str(mode_t m)
 	return str;
 }
 
-static char *time_to_str(time_t mtime)
+/*
+ * Broken down local time of @t.  File times in a listing are mostly from
+ * a few days, so the date of the last day seen is kept, and within that
+ * day the time of day is plain arithmetic.  Days when the UTC offset
+ * changes, DST, are not kept.  The time zone is read once, by tzset() at
+ * startup, after that glibc's localtime_r() does not look at it again.
+ */
+static struct tm *local_tm(time_t t, struct tm *tm)
 {
-	struct tm *t = localtime(&mtime);
-	static char str[20];
+	static time_t start, end;	/* Day kept, [start, end) */
+	static struct tm day;		/* At start, 00:00:00 */
+	time_t secs;
 
-	setlocale(LC_TIME, "C");
-	strftime(str, sizeof(str), "%b %e %H:%M", t);
+	if (t >= start && t < end) {
+		secs = t - start;
+		*tm = day;
+		tm->tm_hour = secs / 3600;
+		tm->tm_min  = secs / 60 % 60;
+		tm->tm_sec  = secs % 60;
+
+		return tm;
+	}
+
+	if (!localtime_r(&t, tm))
+		return NULL;
+
+	start = t - (tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec);
+	end   = start + 86400;
+	if (localtime_r(&start, &day) && day.tm_gmtoff == tm->tm_gmtoff &&
+	    !day.tm_hour && !day.tm_min && !day.tm_sec) {
+		struct tm last;
+
+		secs = end - 1;
+		if (localtime_r(&secs, &last) && last.tm_gmtoff == tm->tm_gmtoff)
+			return tm;
+	}
+	start = end = 0;
+
+	return tm;
+}
+
+static char *time_to_str(time_t mtime, char *str, size_t len)
+{
+	struct tm t;
+
+	if (!local_tm(mtime, &t) || !strftime(str, len, "%b %e %H:%M", &t))
+		str[0] = 0;
 
 	return str;
 }
 
-static char *mlsd_time(time_t mtime)
+static char *mlsd_time(time_t mtime, char *str, size_t len)
 {
-	struct tm *t = localtime(&mtime);
-	static char str[20];
+	struct tm t;
 
-	strftime(str, sizeof(str), "%Y%m%d%H%M%S", t);
+	if (!local_tm(mtime, &t) || !strftime(str, len, "%Y%m%d%H%M%S", &t))
+		str[0] = 0;
 
 	return str;
 }
@@ -597,12 +942,12 @@ static const char *mlsd_type(char *name, int mode)
 
 void mlsd_fact(char fact, char *buf, size_t len, char *name, char *perms, struct stat *st)
 {
-	char size[20];
+	char str[32];
 
 	switch (fact) {
 	case 'm':
 		strlcat(buf, "modify=", len);
-		strlcat(buf, mlsd_time(st->st_mtime), len);
+		strlcat(buf, mlsd_time(st->st_mtime, str, sizeof(str)), len);
 		break;
 
 	case 'p':
@@ -619,8 +964,8 @@ void mlsd_fact(char fact, char *buf, size_t len, char *name, char *perms, struct
 	case 's':
 		if (S_ISDIR(st->st_mode))
 			return;
-		snprintf(size, sizeof(size), "size=%" PRIu64, (uint64_t)st->st_size);
-		strlcat(buf, size, len);
+		snprintf(str, sizeof(str), "size=%" PRIu64, (uint64_t)st->st_size);
+		strlcat(buf, str, len);
 		break;
 
 	default:
@@ -630,16 +975,88 @@ void mlsd_fact(char fact, char *buf, size_t len, char *name, char *perms, struct
 	strlcat(buf, ";", len);
 }
 
+static int in_group(ctrl_t *ctrl, gid_t gid)
+{
+	if (gid == ctrl->gid)
+		return 1;
+
+	for (int i = 0; i < ctrl->ngroups; i++) {
+		if (ctrl->groups[i] == gid)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The same check access(2) does, only from already fetched stat data
+ * and the credentials it uses, the real uid/gid, saved at login.
+ */
+static int perm_ok(ctrl_t *ctrl, struct stat *st, int how)
+{
+	mode_t mode = st->st_mode;
+
+	if (ctrl->uid == 0) {
+		if (how & X_OK)
+			return S_ISDIR(mode) || (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+		return 1;
+	}
+
+	if (st->st_uid == ctrl->uid)
+		mode >>= 6;
+	else if (in_group(ctrl, st->st_gid))
+		mode >>= 3;
+
+	return (mode & how) == (mode_t)how;
+}
+
+/*
+ * Look up the directory @path is in once, not for every entry in it: if
+ * we can search it, needed to CWD to a subdirectory, and if it is on a
+ * read-only file system, where nothing is writable regardless of mode.
+ */
+static void perm_dir(ctrl_t *ctrl, char *path)
+{
+	char *ptr = strrchr(path, '/');
+	size_t len = ptr && ptr != path ? (size_t)(ptr - path) : 1;
+	struct statvfs sv;
+	struct stat st;
+
+	if (ctrl->pdir && !strncmp(ctrl->pdir, path, len) && !ctrl->pdir[len])
+		return;
+
+	free(ctrl->pdir);
+	ctrl->pdir     = strndup(path, len);
+	ctrl->pdir_x   = 0;
+	ctrl->pdir_ro  = 0;
+	ctrl->pdir_dev = 0;
+	if (!ctrl->pdir || stat(ctrl->pdir, &st))
+		return;
+
+	ctrl->pdir_x   = perm_ok(ctrl, &st, X_OK);
+	ctrl->pdir_dev = st.st_dev;
+	if (!statvfs(ctrl->pdir, &sv))
+		ctrl->pdir_ro = !!(sv.f_flag & ST_RDONLY);
+}
+
 static void mlsd_printf(ctrl_t *ctrl, char *buf, size_t len, char *path, char *name, struct stat *st)
 {
 	char perms[10] = "";
-	int ro = !access(path, R_OK);
-	int rw = !access(path, W_OK);
+	int ro, rw;
+
+	perm_dir(ctrl, path);
+	ro = perm_ok(ctrl, st, R_OK);
+	rw = perm_ok(ctrl, st, W_OK);
+	if (rw && st->st_dev != ctrl->pdir_dev)
+		rw = !access(path, W_OK); /* Mount point, let the kernel decide */
+	else if (ctrl->pdir_ro)
+		rw = 0;
 
 	if (S_ISDIR(st->st_mode)) {
-		/* XXX: Verify 'e' by checking that we can CD to the 'name' */
 		if (ro)
-			strlcat(perms, "le", sizeof(perms));
+			strlcat(perms, "l", sizeof(perms));
+		if (ctrl->pdir_x && perm_ok(ctrl, st, X_OK))
+			strlcat(perms, "e", sizeof(perms));
 		if (rw)
 			strlcat(perms, "pc", sizeof(perms)); /* 'd' RMD, 'm' MKD */
 	} else {
@@ -663,6 +1080,7 @@ static void mlsd_printf(ctrl_t *ctrl, char *buf, size_t len, char *path, char *n
 
 static int list_printf(ctrl_t *ctrl, char *buf, size_t len, char *path, char *name)
 {
+	char mode[11], mtime[20];
 	struct stat st;
 
 	if (stat(path, &st))
@@ -681,24 +1099,33 @@ static int list_printf(ctrl_t *ctrl, char *buf, size_t len, char *path, char *na
 
 	case LISTMODE_LIST:
 		snprintf(buf, len, "%s 1 %5d %5d %12" PRIu64 " %s %s\r\n",
-			 mode_to_str(st.st_mode),
+			 mode_to_str(st.st_mode, mode, sizeof(mode)),
 			 0, 0, (uint64_t)st.st_size,
-			 time_to_str(st.st_mtime), name);
+			 time_to_str(st.st_mtime, mtime, sizeof(mtime)), name);
 		break;
 	}
 
 	return 0;
 }
 
+/* Done with MLST, in MODE B the data connection is kept, see list() */
+static void mlst_done(ctrl_t *ctrl)
+{
+	if (ctrl->mode == MODE_B)
+		transfer_free(ctrl);
+	else
+		do_abort(ctrl);
+}
+
 static void do_MLST(ctrl_t *ctrl)
 {
 	char buf[512] = { 0 };
-	char cwd[PATH_MAX];
+	char cwd[PATH_MAX], rpath[PATH_MAX];
 	int sd = ctrl->sd;
 	char *path;
 	int len;
 
-	if (ctrl->data_sd != -1)
+	if (ctrl->data_sd != -1 && ctrl->mode != MODE_B)
 		sd = ctrl->data_sd;
 
 	len = snprintf(buf, sizeof(buf), "250- Listing %s\r\n", ctrl->file);
@@ -706,51 +1133,293 @@ static void do_MLST(ctrl_t *ctrl)
 		goto abort;
 
 	strlcpy(cwd, ctrl->file, sizeof(cwd));
-	path = compose_path(ctrl, cwd);
+	path = compose_path(ctrl, cwd, rpath, sizeof(rpath));
 	if (!path)
 		goto abort;
 
 	if (list_printf(ctrl, &buf[len], sizeof(buf) -  len, path, basename(ctrl->file))) {
 	abort:
-		do_abort(ctrl);
-		send_msg(ctrl->sd, "550 No such file or directory.\r\n");
+		mlst_done(ctrl);
+		send_msg(ctrl, "550 No such file or directory.\r\n");
 		return;
 	}
 
 	strlcat(buf, "250 End.\r\n", sizeof(buf));
-	send_msg(sd, buf);
-	do_abort(ctrl);
+	if (sd == ctrl->sd)
+		send_msg(ctrl, buf);
+	else if (send(sd, buf, strlen(buf), 0) < 0)
+		ERR(errno, "Failed sending MLST reply to client");
+	mlst_done(ctrl);
 }
 
 static void do_MLSD(ctrl_t *ctrl)
 {
 	char buf[512] = { 0 };
-	char cwd[PATH_MAX];
+	char cwd[PATH_MAX], rpath[PATH_MAX];
 	char *path;
 
 	strlcpy(cwd, ctrl->file, sizeof(cwd));
-	path = compose_path(ctrl, cwd);
+	path = compose_path(ctrl, cwd, rpath, sizeof(rpath));
 	if (!path)
 		goto abort;
 
 	if (list_printf(ctrl, buf, sizeof(buf), path, basename(path))) {
 	abort:
 		do_abort(ctrl);
-		send_msg(ctrl->sd, "550 No such file or directory.\r\n");
+		send_msg(ctrl, "550 No such file or directory.\r\n");
 		return;
 	}
 
-	send_msg(ctrl->data_sd, buf);
-	do_abort(ctrl);
-	send_msg(ctrl->sd, "226 Transfer complete.\r\n");
+	if (-1 == data_send(ctrl, buf, strlen(buf), 0)) {
+		do_abort(ctrl);
+		send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
+		return;
+	}
+	do_complete(ctrl, 1);
+}
+
+/*
+ * Check the listing cache for directory @path.  On a hit the listing is
+ * in ctrl->ls, on a miss ctrl->ls collects the output for list_store().
+ */
+static int list_cached(ctrl_t *ctrl, char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) || !S_ISDIR(st.st_mode) || cache_key(ctrl, &st, &ctrl->lskey))
+		return 0;
+
+	if (!cache_get(&ctrl->lskey, &ctrl->ls, &ctrl->lslen)) {
+		DBG("Listing %s from cache, %zu bytes", path, ctrl->lslen);
+		ctrl->lspos = 0;
+		return 1;
+	}
+
+	ctrl->ls = malloc(CACHE_SLOTSZ);
+	ctrl->lslen = 0;
+
+	return 0;
+}
+
+static void list_collect(ctrl_t *ctrl, char *buf)
+{
+	size_t len = strlen(buf);
+
+	/* Too big for a cache slot, stop collecting */
+	if (ctrl->lslen + len > CACHE_SLOTSZ) {
+		free(ctrl->ls);
+		ctrl->ls = NULL;
+		return;
+	}
+
+	memcpy(&ctrl->ls[ctrl->lslen], buf, len);
+	ctrl->lslen += len;
+}
+
+/* Store collected listing, unless the directory changed meanwhile */
+static void list_store(ctrl_t *ctrl)
+{
+	struct stat st;
+	lskey_t key;
+
+	if (fstat(ctrl->d->fd, &st) || cache_key(ctrl, &st, &key))
+		return;
+
+	if (!memcmp(&key, &ctrl->lskey, sizeof(key)))
+		cache_put(&key, ctrl->ls, ctrl->lslen);
+}
+
+/* Send listing from cache, in chunks, as the data connection allows */
+static void list_replay(ctrl_t *ctrl)
+{
+	size_t len = MIN(ctrl->lslen - ctrl->lspos, BUFFER_SIZE);
+	ssize_t bytes;
+
+	if (len > 0) {
+		bytes = data_send(ctrl, &ctrl->ls[ctrl->lspos], len, 0);
+		if (-1 == bytes) {
+			if (ECONNRESET == errno)
+				DBG("Connection reset by client.");
+			else
+				ERR(errno, "Failed sending listing to client");
+
+			do_abort(ctrl);
+			send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
+			return;
+		}
+
+		ctrl->lspos += bytes;
+		if (ctrl->lspos < ctrl->lslen)
+			return;
+	}
+
+	do_complete(ctrl, 1);
+}
+
+static void list_send(ctrl_t *ctrl, char *buf)
+{
+	if (-1 == data_send(ctrl, buf, strlen(buf), 0)) {
+		if (ECONNRESET == errno)
+			DBG("Connection reset by client.");
+		else
+			ERR(errno, "Failed sending file %s to client", ctrl->file);
+
+		do_abort(ctrl);
+		send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
+	}
+}
+
+static int walk_push(ctrl_t *ctrl, char *path, int depth)
+{
+	walk_t *w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -1;
+
+	w->path = strdup(path);
+	if (!w->path) {
+		free(w);
+		return -1;
+	}
+
+	w->depth = depth;
+	w->up = ctrl->walk;
+	ctrl->walk = w;
+
+	return 0;
+}
+
+static void walk_pop(ctrl_t *ctrl)
+{
+	walk_t *w = ctrl->walk;
+
+	ctrl->walk = w->up;
+	free(w->queue);
+	free(w->path);
+	free(w);
+}
+
+void walk_free(ctrl_t *ctrl)
+{
+	while (ctrl->walk)
+		walk_pop(ctrl);
+}
+
+/* Only descend into real directories, never follow symlinks */
+static int walk_isdir(ctrl_t *ctrl, char *name)
+{
+	struct stat st;
+
+	if (ctrl->d->type != DT_UNKNOWN)
+		return ctrl->d->type == DT_DIR;
+
+	return !fstatat(ctrl->d->fd, name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Sorting reads the whole directory in one go, with -o single that would
+ * hold up all sessions for as long as it takes, so listings are streamed
+ * a batch of entries per event, in directory order.
+ */
+static int list_sorted(int mode)
+{
+	return mode == LISTMODE_LIST && !do_single;
+}
+
+static void walk_add(ctrl_t *ctrl, char *name)
+{
+	walk_t *w = ctrl->walk;
+	size_t len = strlen(name) + 1;
+
+	if (w->depth >= list_depth)
+		return;
+
+	if (w->len + len > w->size) {
+		size_t size = MAX(w->size * 2, 4096);
+		char *ptr;
+
+		while (size < w->len + len)
+			size *= 2;
+		if (size > LIST_QUEUE_MAX) {
+			INFO("%s: LIST: Too many subdirectories in %s, skipping %s",
+			     ctrl->clientaddr, w->path, name);
+			return;
+		}
+
+		ptr = realloc(w->queue, size);
+		if (!ptr) {
+			ERR(errno, "Failed queuing %s/%s for recursive listing", w->path, name);
+			return;
+		}
+		w->queue = ptr;
+		w->size  = size;
+	}
+
+	memcpy(&w->queue[w->len], name, len);
+	w->len += len;
+}
+
+/*
+ * Move on to the next queued subdirectory and put its heading in @buf.
+ * Returns non-zero when the whole tree has been listed.
+ */
+static int walk_next(ctrl_t *ctrl, char *buf, size_t len)
+{
+	walk_t *w;
+
+	while ((w = ctrl->walk)) {
+		char dir[PATH_MAX], rpath[PATH_MAX];
+		char *name, *path, *file;
+		dir_t *d;
+
+		if (w->pos >= w->len) {
+			walk_pop(ctrl);
+			continue;
+		}
+
+		name = &w->queue[w->pos];
+		w->pos += strlen(name) + 1;
+
+		if ((size_t)snprintf(dir, sizeof(dir), "%s/%s", w->path, name) >= sizeof(dir))
+			continue;
+
+		path = compose_path(ctrl, dir, rpath, sizeof(rpath));
+		if (!path)
+			continue;
+
+		d = dir_open(path, list_sorted(ctrl->list_mode));
+		if (!d) {
+			INFO("%s: LIST: Failed reading directory %s: %m", ctrl->clientaddr, dir);
+			continue;
+		}
+
+		file = strdup(dir);
+		if (!file || walk_push(ctrl, dir, w->depth + 1)) {
+			ERR(errno, "Failed listing %s, stopping recursive listing", dir);
+			free(file);
+			dir_close(d);
+			return 1;
+		}
+
+		dir_close(ctrl->d);
+		ctrl->d = d;
+		free(ctrl->file);
+		ctrl->file = file;
+
+		snprintf(buf, len, "\r\n%s:\r\n", dir);
+		return 0;
+	}
+
+	return 1;
 }
 
 static void do_LIST(uev_t *w, void *arg, int events)
 {
 	ctrl_t *ctrl = (ctrl_t *)arg;
-	struct timeval tv;
-	ssize_t bytes;
 	char buf[BUFFER_SIZE] = { 0 };
+	char *name;
+	int rc;
 
 	if (UEV_ERROR == events || UEV_HUP == events) {
 		uev_io_start(w);
@@ -758,7 +1427,17 @@ static void do_LIST(uev_t *w, void *arg, int events)
 	}
 
 	/* Reset inactivity timer. */
-	uev_timer_set(&ctrl->timeout_watcher, INACTIVITY_TIMER, 0);
+	session_touch(ctrl);
+
+	/* MODE B, rest of the previous block first */
+	rc = data_flush(ctrl);
+	if (rc < 0) {
+		ERR(errno, "Failed sending listing to client");
+		do_abort(ctrl);
+		send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
+	}
+	if (rc)
+		return;
 
 	if (ctrl->d_num == -1) {
 		if (ctrl->list_mode == LISTMODE_MLST)
@@ -768,20 +1447,22 @@ static void do_LIST(uev_t *w, void *arg, int events)
 		return;
 	}
 
-	gettimeofday(&tv, NULL);
-	if (tv.tv_sec - ctrl->tv.tv_sec > 3) {
-		DBG("Sending LIST entry %d of %d to %s ...", ctrl->i, ctrl->d_num, ctrl->clientaddr);
-		ctrl->tv.tv_sec = tv.tv_sec;
+	if (!ctrl->d) {
+		list_replay(ctrl);
+		return;
 	}
 
-	while (ctrl->i < ctrl->d_num) {
-		struct dirent *entry;
-		char cwd[PATH_MAX];
-		char *name, *path;
+	if (clock_now() - ctrl->progress > 3) {
+		DBG("Sending LIST entry %d to %s ...", ctrl->i, ctrl->clientaddr);
+		ctrl->progress = clock_now();
+	}
+
+	while ((name = dir_read(ctrl->d))) {
+		char cwd[PATH_MAX], rpath[PATH_MAX];
+		char *path;
 		size_t len;
 
-		entry = ctrl->d[ctrl->i++];
-		name  = entry->d_name;
+		ctrl->i++;
 
 		DBG("Found directory entry %s", name);
 		if (!strcmp(name, ".") || !strcmp(name, ".."))
@@ -791,7 +1472,7 @@ static void do_LIST(uev_t *w, void *arg, int events)
 		snprintf(cwd, sizeof(cwd), "%s%s%s", ctrl->file,
 			 ctrl->file[len > 0 ? len - 1 : len] == '/' ? "" : "/", name);
 
-		path = compose_path(ctrl, cwd);
+		path = compose_path(ctrl, cwd, rpath, sizeof(rpath));
 		if (!path) {
 		fail:
 			INFO("%s: LIST: Failed reading status for %s: %m", ctrl->clientaddr, path ? path : name);
@@ -802,23 +1483,32 @@ static void do_LIST(uev_t *w, void *arg, int events)
 			goto fail;
 
 		DBG("LIST %s", buf);
+		if (ctrl->ls)
+			list_collect(ctrl, buf);
+		if (ctrl->walk && walk_isdir(ctrl, name))
+			walk_add(ctrl, name);
 
-		bytes = send(ctrl->data_sd, buf, strlen(buf), 0);
-		if (-1 == bytes) {
-			if (ECONNRESET == errno)
-				DBG("Connection reset by client.");
-			else
-				ERR(errno, "Failed sending file %s to client", ctrl->file);
+		list_send(ctrl, buf);
+		return;
+	}
 
-			do_abort(ctrl);
-			send_msg(ctrl->sd, "426 TCP connection was established but then broken!\r\n");
-		}
+	/* Never report a listing cut short by a read error as complete */
+	if (ctrl->d->err) {
+		do_abort(ctrl);
+		send_msg(ctrl, "451 Trouble listing directory.\r\n");
+		return;
+	}
 
+	/* LIST -R, heading of next subdirectory */
+	if (ctrl->walk && !walk_next(ctrl, buf, sizeof(buf))) {
+		list_send(ctrl, buf);
 		return;
 	}
 
-	do_abort(ctrl);
-	send_msg(ctrl->sd, "226 Transfer complete.\r\n");
+	if (ctrl->ls)
+		list_store(ctrl);
+
+	do_complete(ctrl, 1);
 }
 
 static const char *mode2op(int mode)
@@ -833,26 +1523,36 @@ static const char *mode2op(int mode)
 	return "LST?";
 }
 
+/* Skip any ls(1) style flags the client sends, only -R is used */
+static char *list_args(char *arg, int *recurse)
+{
+	while (*arg) {
+		while (isspace(*arg))
+			arg++;
+
+		if (*arg != '-')
+			break;
+
+		while (*arg && !isspace(*arg)) {
+			if (*arg == 'R' && recurse)
+				*recurse = 1;
+			arg++;
+		}
+	}
+
+	return arg;
+}
+
 static void list(ctrl_t *ctrl, char *arg, int mode)
 {
+	char rpath[PATH_MAX];
+	int recurse = 0;
 	char *path;
 
 	if (string_valid(arg)) {
 		char *ptr, *quot;
 
-		/* Check if client sends ls arguments ... */
-		ptr = arg;
-		while (*ptr) {
-			if (isspace(*ptr))
-				ptr++;
-
-			if (*ptr == '-') {
-				while (*ptr && !isspace(*ptr))
-					ptr++;
-			}
-
-			break;
-		}
+		ptr = list_args(arg, &recurse);
 
 		/* Strip any "" from "<arg>" */
 		while ((quot = strchr(ptr, '"'))) {
@@ -869,31 +1569,68 @@ static void list(ctrl_t *ctrl, char *arg, int mode)
 	}
 
 	if (mode >= LISTMODE_MLST)
-		path = compose_abspath(ctrl, arg);
+		path = compose_abspath(ctrl, arg, rpath, sizeof(rpath));
 	else
-		path = compose_path(ctrl, arg);
+		path = compose_path(ctrl, arg, rpath, sizeof(rpath));
 	if (!path) {
 		INFO("%s: %s: invalid path to %s: %m", ctrl->clientaddr, mode2op(mode), arg);
-		send_msg(ctrl->sd, "550 No such file or directory.\r\n");
+		send_msg(ctrl, "550 No such file or directory.\r\n");
 		return;
 	}
 
 	ctrl->list_mode = mode;
 	ctrl->file = strdup(arg ? arg : "");
 	ctrl->i = 0;
-	ctrl->d_num = scandir(path, &ctrl->d, NULL, alphasort);
-	if (ctrl->d_num == -1) {
+
+	/*
+	 * In MODE B the data connection carries blocks, and is kept open
+	 * between transfers, so MLST is always on the control connection,
+	 * where RFC 3659 has it anyway.
+	 */
+	if (mode == LISTMODE_MLST && ctrl->mode == MODE_B) {
+		do_MLST(ctrl);
+		return;
+	}
+
+	/* No standard way to recurse MLSD, and no point caching trees */
+	if (mode != LISTMODE_LIST && mode != LISTMODE_NLST)
+		recurse = 0;
+	if (!recurse && mode != LISTMODE_MLST && list_cached(ctrl, path))
+		goto start;
+
+	/*
+	 * Only LIST output is sorted, like ls(1).  NLST and MLSD entries
+	 * are streamed in directory order, without reading it all first,
+	 * as is everything with -o single, see list_sorted().
+	 */
+	ctrl->d = dir_open(path, list_sorted(mode));
+	if (!ctrl->d) {
+		ctrl->d_num = -1;
 		if (access(path, R_OK)) {
-			send_msg(ctrl->sd, "550 No such file or directory.\r\n");
+			send_msg(ctrl, "550 No such file or directory.\r\n");
 			DBG("Failed reading directory '%s': %s", path, strerror(errno));
+			free(ctrl->file);
+			ctrl->file = NULL;
+			free(ctrl->ls);
+			ctrl->ls = NULL;
+			return;
+		}
+	} else {
+		ctrl->d_num = ctrl->d->num;
+		if (recurse && list_depth > 0 &&
+		    walk_push(ctrl, ctrl->file[0] ? ctrl->file : ".", 0)) {
+			ERR(errno, "Failed starting recursive listing of %s", path);
+			do_abort(ctrl);
+			send_msg(ctrl, "451 Trouble listing directory.\r\n");
 			return;
 		}
 	}
 
 	DBG("Reading directory %s ... %d number of entries", path, ctrl->d_num);
+start:
 	if (ctrl->data_sd > -1) {
-		send_msg(ctrl->sd, "125 Data connection already open; transfer starting.\r\n");
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_LIST, ctrl, ctrl->data_sd, UEV_WRITE);
+		send_msg(ctrl, "125 Data connection already open; transfer starting.\r\n");
+		data_watch(ctrl, do_LIST, ctrl->data_sd, UEV_WRITE);
 		return;
 	}
 
@@ -920,21 +1657,11 @@ static void handle_MLSD(ctrl_t *ctrl, char *arg)
 	list(ctrl, arg, LISTMODE_MLSD);
 }
 
-static void do_pasv_connection(uev_t *w, void *arg, int events)
+/* Data connection up, start the transfer queued by RETR, STOR or LIST */
+static void start_pending(ctrl_t *ctrl, int pasv)
 {
-	ctrl_t *ctrl = (ctrl_t *)arg;
 	int rc = 0;
 
-	if (UEV_ERROR == events || UEV_HUP == events) {
-		DBG("error on data_listen_sd ...");
-		uev_io_start(w);
-		return;
-	}
-	DBG("Event on data_listen_sd ...");
-	uev_io_stop(&ctrl->data_watcher);
-	if (open_data_connection(ctrl))
-		return;
-
 	switch (ctrl->pending) {
 	case PENDING_STOR:
 		/* fallthrough */
@@ -943,94 +1670,125 @@ static void do_pasv_connection(uev_t *w, void *arg, int events)
 			rc = fseek(ctrl->fp, ctrl->offset, SEEK_SET);
 		if (rc) {
 			do_abort(ctrl);
-			send_msg(ctrl->sd, "551 Failed seeking to that position in file.\r\n");
+			send_msg(ctrl, "551 Failed seeking to that position in file.\r\n");
+			return;
+		}
+		/* fallthrough */
+	case PENDING_LIST:
+		break;
+
+	case PENDING_NONE:
+		DBG("No pending command, waiting ...");
+		return;
+	}
+
+	switch (ctrl->pending) {
+	case PENDING_STOR:
+		DBG("Pending STOR, starting ...");
+		data_watch(ctrl, do_STOR, ctrl->data_sd, UEV_READ);
+		break;
+
+	case PENDING_RETR:
+		DBG("Pending RETR, starting ...");
+		data_watch(ctrl, do_RETR, ctrl->data_sd, UEV_WRITE);
+		break;
+
+	case PENDING_LIST:
+		DBG("Pending LIST, starting ...");
+		data_watch(ctrl, do_LIST, ctrl->data_sd, UEV_WRITE);
+		break;
+
+	case PENDING_NONE:
+		/* cannot get here */
+		return;
+	}
+
+	if (!pasv) {
+		if (ctrl->pending != PENDING_LIST || ctrl->list_mode != LISTMODE_MLST)
+			send_msg(ctrl, "150 Data connection opened; transfer starting.\r\n");
+	} else if (ctrl->pending == PENDING_LIST && ctrl->list_mode == LISTMODE_MLST)
+		send_msg(ctrl, "150 Opening ASCII mode data connection for MLSD.\r\n");
+	else
+		send_msg(ctrl, "150 Data connection accepted; transfer starting.\r\n");
+	ctrl->pending = PENDING_NONE;
+}
+
+static void do_pasv_connection(uev_t *w, void *arg, int events)
+{
+	ctrl_t *ctrl = (ctrl_t *)arg;
+
+	if (UEV_ERROR == events || UEV_HUP == events) {
+		DBG("error on data_listen_sd ...");
+		uev_io_start(w);
+		return;
+	}
+	DBG("Event on data_listen_sd ...");
+	uev_io_stop(&ctrl->data_watcher);
+	if (open_data_connection(ctrl)) {
+		if (again(errno)) {
+			uev_io_start(&ctrl->data_watcher);
 			return;
 		}
-		/* fallthrough */
-	case PENDING_LIST:
-		break;
 
-	case PENDING_NONE:
-		DBG("No pending command, waiting ...");
+		if (ctrl->pending != PENDING_NONE)
+			send_msg(ctrl, "425 TCP connection cannot be established.\r\n");
+		do_abort(ctrl);
 		return;
 	}
 
-	switch (ctrl->pending) {
-	case PENDING_STOR:
-		DBG("Pending STOR, starting ...");
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_STOR, ctrl, ctrl->data_sd, UEV_READ);
-		break;
-
-	case PENDING_RETR:
-		DBG("Pending RETR, starting ...");
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_RETR, ctrl, ctrl->data_sd, UEV_WRITE);
-		break;
+	start_pending(ctrl, 1);
+}
 
-	case PENDING_LIST:
-		DBG("Pending LIST, starting ...");
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_LIST, ctrl, ctrl->data_sd, UEV_WRITE);
-		break;
+/* Active mode connect() to the client done, or failed */
+static void do_port_connection(uev_t *w, void *arg, int events)
+{
+	ctrl_t *ctrl = (ctrl_t *)arg;
+	socklen_t len = sizeof(int);
+	int err = 0;
 
-	case PENDING_NONE:
-		/* cannot get here */
+	uev_io_stop(&ctrl->data_watcher);
+	if (getsockopt(ctrl->data_sd, SOL_SOCKET, SO_ERROR, &err, &len) || err || UEV_ERROR == events) {
+		ERR(err, "Failed connecting data socket to client %s:%d", ctrl->data_address, ctrl->data_port);
+		do_abort(ctrl);
+		send_msg(ctrl, "425 TCP connection cannot be established.\r\n");
 		return;
 	}
 
-	if (ctrl->pending == PENDING_LIST && ctrl->list_mode == LISTMODE_MLST)
-		send_msg(ctrl->sd, "150 Opening ASCII mode data connection for MLSD.\r\n");
-	else
-		send_msg(ctrl->sd, "150 Data connection accepted; transfer starting.\r\n");
-	ctrl->pending = PENDING_NONE;
+	DBG("Connected to client's previously requested address:PORT %s:%d",
+	    ctrl->data_address, ctrl->data_port);
+	start_pending(ctrl, 0);
 }
 
 static int do_PASV(ctrl_t *ctrl, char *arg, inet_addr_t *data, socklen_t *len)
 {
-	inet_addr_t server;
-
 	if (ctrl->data_sd > 0) {
 		close(ctrl->data_sd);
 		ctrl->data_sd = -1;
 	}
 
-	if (ctrl->data_listen_sd > 0)
-		close(ctrl->data_listen_sd);
+	pasv_close(ctrl);
 
-	ctrl->data_listen_sd = socket(ctrl->server_sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	ctrl->data_listen_sd = pasv_open(ctrl);
 	if (ctrl->data_listen_sd < 0) {
-		ERR(errno, "Failed opening data server socket");
-		send_msg(ctrl->sd, "426 Internal server error.\r\n");
-		return 1;
-	}
-
-	/* Listen on the same local address the control channel arrived on */
-	memcpy(&server, &ctrl->server_sa, sizeof(server));
-	inet_set_port(&server, 0);
-	if (bind(ctrl->data_listen_sd, (struct sockaddr *)&server, inet_len(&server)) < 0) {
-		ERR(errno, "Failed binding to client socket");
-		send_msg(ctrl->sd, "426 Internal server error.\r\n");
-		close(ctrl->data_listen_sd);
-		ctrl->data_listen_sd = -1;
+		if (EAGAIN == errno) {
+			WARN(0, "No free PASV port, all %d-%d busy", pasv_min, pasv_max);
+			send_msg(ctrl, "425 No free passive port, try again later.\r\n");
+		} else {
+			ERR(errno, "Failed opening data server socket");
+			send_msg(ctrl, "426 Internal server error.\r\n");
+		}
 		return 1;
 	}
-
 	INFO("Data server port established.  Waiting for client to connect ...");
-	if (listen(ctrl->data_listen_sd, 1) < 0) {
-		ERR(errno, "Client data connection failure");
-		send_msg(ctrl->sd, "426 Internal server error.\r\n");
-		close(ctrl->data_listen_sd);
-		ctrl->data_listen_sd = -1;
-		return 1;
-	}
 
 	memset(data, 0, sizeof(*data));
 	if (-1 == getsockname(ctrl->data_listen_sd, (struct sockaddr *)data, len)) {
 		ERR(errno, "Cannot determine our address, need it if client should connect to us");
-		close(ctrl->data_listen_sd);
-		ctrl->data_listen_sd = -1;
+		pasv_close(ctrl);
 		return 1;
 	}
 
-	uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_pasv_connection, ctrl, ctrl->data_listen_sd, UEV_READ);
+	data_watch(ctrl, do_pasv_connection, ctrl->data_listen_sd, UEV_READ);
 
 	return 0;
 }
@@ -1044,7 +1802,7 @@ static void handle_PASV(ctrl_t *ctrl, char *arg)
 
 	/* The 227 reply can only carry an IPv4 address, IPv6 clients use EPSV */
 	if (ctrl->server_sa.ss_family != AF_INET) {
-		send_msg(ctrl->sd, "522 Use EPSV for IPv6.\r\n");
+		send_msg(ctrl, "522 Use EPSV for IPv6.\r\n");
 		return;
 	}
 
@@ -1057,8 +1815,9 @@ static void handle_PASV(ctrl_t *ctrl, char *arg)
 	else
 		msg = strdup(ctrl->serveraddr);
 	if (!msg) {
-		send_msg(ctrl->sd, "426 Internal server error.\r\n");
-		exit(1);
+		send_msg(ctrl, "426 Internal server error.\r\n");
+		session_exit(ctrl);
+		return;
 	}
 	p = msg;
 	while ((p = strchr(p, '.')))
@@ -1067,7 +1826,7 @@ static void handle_PASV(ctrl_t *ctrl, char *arg)
 	port = inet_port(&data);
 	snprintf(buf, sizeof(buf), "227 Entering Passive Mode (%s,%d,%d)\r\n",
 		 msg, port / 256, port % 256);
-	send_msg(ctrl->sd, buf);
+	send_msg(ctrl, buf);
 
 	free(msg);
 }
@@ -1079,7 +1838,7 @@ static void handle_EPSV(ctrl_t *ctrl, char *arg)
 	char buf[200];
 
 	if (string_valid(arg) && string_case_compare(arg, "ALL")) {
-		send_msg(ctrl->sd, "200 Command OK\r\n");
+		send_msg(ctrl, "200 Command OK\r\n");
 		return;
 	}
 
@@ -1087,15 +1846,15 @@ static void handle_EPSV(ctrl_t *ctrl, char *arg)
 		return;
 
 	snprintf(buf, sizeof(buf), "229 Entering Extended Passive Mode (|||%d|)\r\n", inet_port(&data));
-	send_msg(ctrl->sd, buf);
+	send_msg(ctrl, buf);
 }
 
 static void do_RETR(uev_t *w, void *arg, int events)
 {
 	ctrl_t *ctrl = (ctrl_t *)arg;
-	struct timeval tv;
 	ssize_t bytes;
 	size_t num;
+	int rc;
 	char buf[BUFFER_SIZE];
 
 	if (UEV_ERROR == events || UEV_HUP == events) {
@@ -1109,27 +1868,38 @@ static void do_RETR(uev_t *w, void *arg, int events)
 		return;
 	}
 
+	/* MODE B, rest of the previous block first */
+	rc = data_flush(ctrl);
+	if (rc < 0) {
+		ERR(errno, "Failed sending file %s to client", ctrl->file);
+		do_abort(ctrl);
+		send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
+	}
+	if (rc)
+		return;
+
 	num = fread(buf, sizeof(char), sizeof(buf), ctrl->fp);
 	if (!num) {
 		if (feof(ctrl->fp))
 			LOG("User %s from %s downloaded '%s'", ctrl->name, ctrl->clientaddr, ctrl->file);
 		else if (ferror(ctrl->fp))
 			ERR(0, "Error while reading %s", ctrl->file);
-		do_abort(ctrl);
-		send_msg(ctrl->sd, "226 Transfer complete.\r\n");
+		do_complete(ctrl, 1);
 		return;
 	}
 
 	/* Reset inactivity timer. */
-	uev_timer_set(&ctrl->timeout_watcher, INACTIVITY_TIMER, 0);
+	session_touch(ctrl);
 
-	gettimeofday(&tv, NULL);
-	if (tv.tv_sec - ctrl->tv.tv_sec > 3) {
+	if (clock_now() - ctrl->progress > 3) {
 		DBG("Sending %zd bytes of %s to %s ...", num, ctrl->file, ctrl->clientaddr);
-		ctrl->tv.tv_sec = tv.tv_sec;
+		ctrl->progress = clock_now();
 	}
 
-	bytes = send(ctrl->data_sd, buf, num, 0);
+	bytes = data_send(ctrl, buf, num, 0);
+	PROBE2(retr__chunk, ctrl, bytes);
+	if (bytes > 0)
+		ctrl->xfer_bytes += bytes;
 	if (-1 == bytes) {
 		if (ECONNRESET == errno)
 			DBG("Connection reset by client.");
@@ -1137,7 +1907,7 @@ static void do_RETR(uev_t *w, void *arg, int events)
 			ERR(errno, "Failed sending file %s to client", ctrl->file);
 
 		do_abort(ctrl);
-		send_msg(ctrl->sd, "426 TCP connection was established but then broken!\r\n");
+		send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
 	}
 }
 
@@ -1161,75 +1931,60 @@ static void do_PORT(ctrl_t *ctrl, pend_t pending)
 
 	if (open_data_connection(ctrl)) {
 		do_abort(ctrl);
-		send_msg(ctrl->sd, "425 TCP connection cannot be established.\r\n");
+		send_msg(ctrl, "425 TCP connection cannot be established.\r\n");
 		return;
 	}
 
-	if (pending != PENDING_LIST || ctrl->list_mode != LISTMODE_MLST)
-		send_msg(ctrl->sd, "150 Data connection opened; transfer starting.\r\n");
-
-	switch (pending) {
-	case PENDING_STOR:
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_STOR, ctrl, ctrl->data_sd, UEV_READ);
-		break;
-
-	case PENDING_RETR:
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_RETR, ctrl, ctrl->data_sd, UEV_WRITE);
-		break;
-
-	case PENDING_LIST:
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_LIST, ctrl, ctrl->data_sd, UEV_WRITE);
-		break;
-
-	default:
-		ERR(0, "Unhandled pending command (%d) in %s()!", pending, __func__);
-		break;
-	}
-
-	ctrl->pending = PENDING_NONE;
+	/* Transfer starts when connected, see do_port_connection() */
+	ctrl->pending = pending;
+	data_watch(ctrl, do_port_connection, ctrl->data_sd, UEV_WRITE);
 }
 
 static void handle_RETR(ctrl_t *ctrl, char *file)
 {
-	FILE *fp;
-	char *path;
+	FILE *fp = NULL;
 	struct stat st;
+	int fd;
+
+	fd = fcache_take(ctrl, file, &st);
+	if (fd >= 0)
+		fp = fdopen(fd, "rb");
+	if (!fp) {
+		if (fd >= 0)
+			close(fd);
+		if (EACCES == errno) {
+			ERR(errno, "Failed RETR %s for %s", file, ctrl->clientaddr);
+			send_msg(ctrl, "451 Trouble to RETR file.\r\n");
+			return;
+		}
 
-	path = compose_abspath(ctrl, file);
-	if (!path || stat(path, &st)) {
 		INFO("%s: RETR: invalid path to %s: %m", ctrl->clientaddr, file);
-		send_msg(ctrl->sd, "550 No such file or directory.\r\n");
+		send_msg(ctrl, "550 No such file or directory.\r\n");
 		return;
 	}
 	if (!S_ISREG(st.st_mode)) {
-		LOG("%s: Failed opening '%s'. Not a regular file", ctrl->clientaddr, path);
-		send_msg(ctrl->sd, "550 Not a regular file.\r\n");
-		return;
-	}
-
-	fp = fopen(path, "rb");
-	if (!fp) {
-		if (errno != ENOENT)
-			ERR(errno, "Failed RETR %s for %s", path, ctrl->clientaddr);
-		send_msg(ctrl->sd, "451 Trouble to RETR file.\r\n");
+		LOG("%s: Failed opening '%s'. Not a regular file", ctrl->clientaddr, file);
+		send_msg(ctrl, "550 Not a regular file.\r\n");
+		fclose(fp);
 		return;
 	}
 
 	ctrl->fp = fp;
 	ctrl->file = strdup(file);
+	xferlog_start(ctrl, 'o');
 
 	if (ctrl->data_sd > -1) {
 		if (ctrl->offset) {
 			DBG("Previous REST %ld of file size %ld", ctrl->offset, st.st_size);
 			if (fseek(fp, ctrl->offset, SEEK_SET)) {
 				do_abort(ctrl);
-				send_msg(ctrl->sd, "551 Failed seeking to that position in file.\r\n");
+				send_msg(ctrl, "551 Failed seeking to that position in file.\r\n");
 				return;
 			}
 		}
 
-		send_msg(ctrl->sd, "125 Data connection already open; transfer starting.\r\n");
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_RETR, ctrl, ctrl->data_sd, UEV_WRITE);
+		send_msg(ctrl, "125 Data connection already open; transfer starting.\r\n");
+		data_watch(ctrl, do_RETR, ctrl->data_sd, UEV_WRITE);
 		return;
 	}
 
@@ -1243,7 +1998,9 @@ static void handle_MDTM(ctrl_t *ctrl, char *file)
 	struct tm *tm;
 	char *path, *ptr;
 	char *mtime = NULL;
+	char rpath[PATH_MAX];
 	char buf[80];
+	int readable;
 
         if (!file)
 		goto missing;
@@ -1255,11 +2012,10 @@ static void handle_MDTM(ctrl_t *ctrl, char *file)
 		file  = ptr;
         }
 
-	path = compose_abspath(ctrl, file);
-	if (!path || stat(path, &st) || !S_ISREG(st.st_mode)) {
+	if (fcache_stat(ctrl, file, &st, &readable) < 0 || !S_ISREG(st.st_mode)) {
 	missing:
 		INFO("MDTM: invalid path to %s: %m", file);
-		send_msg(ctrl->sd, "550 Not a regular file.\r\n");
+		send_msg(ctrl, "550 Not a regular file.\r\n");
 		return;
 	}
 
@@ -1273,10 +2029,15 @@ static void handle_MDTM(ctrl_t *ctrl, char *file)
 
 		if (!strptime(mtime, "%Y%m%d%H%M%S", &tm)) {
 		fail:
-			send_msg(ctrl->sd, "550 Invalid time format\r\n");
+			send_msg(ctrl, "550 Invalid time format\r\n");
 			return;
 		}
 
+		/* Rare, and times cannot be set via an O_PATH descriptor */
+		path = compose_abspath(ctrl, file, rpath, sizeof(rpath));
+		if (!path)
+			goto fail;
+
 		times[1].tv_sec = mktime(&tm);
 		rc = utimensat(0, path, times, 0);
 		if (rc) {
@@ -1286,21 +2047,22 @@ static void handle_MDTM(ctrl_t *ctrl, char *file)
 
 		LOG("User %s from %s changed mtime of %s", ctrl->name, ctrl->clientaddr, file);
 		(void)stat(path, &st);
+		fcache_flush(ctrl);
 	}
 
 	tm = gmtime(&st.st_mtime);
 	strftime(buf, sizeof(buf), "213 %Y%m%d%H%M%S\r\n", tm);
 
-	send_msg(ctrl->sd, buf);
+	send_msg(ctrl, buf);
 }
 
 static void do_STOR(uev_t *w, void *arg, int events)
 {
 	ctrl_t *ctrl = (ctrl_t *)arg;
-	struct timeval tv;
 	ssize_t bytes;
-	size_t num;
+	size_t num, len;
 	char buf[BUFFER_SIZE];
+	int eof = 0;
 
 	if (UEV_ERROR == events || UEV_HUP == events) {
 		DBG("error on data_sd ...");
@@ -1314,73 +2076,90 @@ static void do_STOR(uev_t *w, void *arg, int events)
 	}
 
 	/* Reset inactivity timer. */
-	uev_timer_set(&ctrl->timeout_watcher, INACTIVITY_TIMER, 0);
+	session_touch(ctrl);
 
-	bytes = recv(ctrl->data_sd, buf, sizeof(buf), 0);
+	/* In MODE B, read no further than the end of the current block */
+	len = sizeof(buf);
+	if (ctrl->mode == MODE_B)
+		len = block_want(ctrl, len);
+
+	bytes = recv(ctrl->data_sd, buf, len, 0);
 	if (bytes < 0) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+			return;
 		if (ECONNRESET == errno)
 			DBG("Connection reset by client.");
 		else
 			ERR(errno, "Failed receiving file %s from client", ctrl->file);
 		do_abort(ctrl);
-		send_msg(ctrl->sd, "426 TCP connection was established but then broken!\r\n");
+		send_msg(ctrl, "426 TCP connection was established but then broken!\r\n");
 		return;
 	}
 	if (bytes == 0) {
+		if (ctrl->mode == MODE_B) {
+			INFO("Client closed data connection before end of file %s", ctrl->file);
+			do_abort(ctrl);
+			send_msg(ctrl, "426 Connection closed; transfer aborted.\r\n");
+			return;
+		}
+
 		LOG("User %s from %s uploaded file %s", ctrl->name, ctrl->clientaddr, ctrl->file);
-		do_abort(ctrl);
-		send_msg(ctrl->sd, "226 Transfer complete.\r\n");
+		do_complete(ctrl, 0);
 		return;
 	}
 
-	gettimeofday(&tv, NULL);
-	if (tv.tv_sec - ctrl->tv.tv_sec > 3) {
+	if (ctrl->mode == MODE_B)
+		bytes = block_recv(ctrl, buf, bytes, &eof);
+
+	if (clock_now() - ctrl->progress > 3) {
 		DBG("Receiving %zd bytes of %s from %s ...", bytes, ctrl->file, ctrl->clientaddr);
-		ctrl->tv.tv_sec = tv.tv_sec;
+		ctrl->progress = clock_now();
 	}
 
 	num = fwrite(buf, 1, bytes, ctrl->fp);
+	PROBE2(stor__chunk, ctrl, num);
+	ctrl->xfer_bytes += num;
 	if ((size_t)bytes != num)
 		ERR(errno, "552 Disk full.");
+
+	if (eof) {
+		LOG("User %s from %s uploaded file %s", ctrl->name, ctrl->clientaddr, ctrl->file);
+		do_complete(ctrl, 0);
+	}
 }
 
 static void handle_STOR(ctrl_t *ctrl, char *file)
 {
 	FILE *fp = NULL;
-	char *path;
 	int rc = 0;
 
-	path = compose_abspath(ctrl, file);
-	if (!path) {
-		INFO("STOR: invalid path to %s: %m", file);
-		goto fail;
-	}
+	fcache_flush(ctrl);
 
-	DBG("Trying to write to %s ...", path);
-	fp = fopen(path, "wb");
+	DBG("Trying to write to %s ...", file);
+	fp = fopen_path(ctrl, file, "wb");
 	if (!fp) {
 		/* If EACCESS client is trying to do something disallowed */
-		ERR(errno, "Failed writing %s", path);
-	fail:
-		send_msg(ctrl->sd, "451 Trouble storing file.\r\n");
+		ERR(errno, "Failed writing %s", file);
+		send_msg(ctrl, "451 Trouble storing file.\r\n");
 		do_abort(ctrl);
 		return;
 	}
 
 	ctrl->fp = fp;
 	ctrl->file = strdup(file);
+	xferlog_start(ctrl, 'i');
 
 	if (ctrl->data_sd > -1) {
 		if (ctrl->offset)
 			rc = fseek(fp, ctrl->offset, SEEK_SET);
 		if (rc) {
 			do_abort(ctrl);
-			send_msg(ctrl->sd, "551 Failed seeking to that position in file.\r\n");
+			send_msg(ctrl, "551 Failed seeking to that position in file.\r\n");
 			return;
 		}
 
-		send_msg(ctrl->sd, "125 Data connection already open; transfer starting.\r\n");
-		uev_io_init(ctrl->ctx, &ctrl->data_watcher, do_STOR, ctrl, ctrl->data_sd, UEV_READ);
+		send_msg(ctrl, "125 Data connection already open; transfer starting.\r\n");
+		data_watch(ctrl, do_STOR, ctrl->data_sd, UEV_READ);
 		return;
 	}
 
@@ -1389,9 +2168,12 @@ static void handle_STOR(ctrl_t *ctrl, char *file)
 
 static void handle_DELE(ctrl_t *ctrl, char *file)
 {
+	char rpath[PATH_MAX];
 	char *path;
 
-	path = compose_abspath(ctrl, file);
+	fcache_flush(ctrl);
+
+	path = compose_abspath(ctrl, file, rpath, sizeof(rpath));
 	if (!path) {
 		INFO("DELE: invalid path to %s: %m", file);
 		goto fail;
@@ -1399,25 +2181,28 @@ static void handle_DELE(ctrl_t *ctrl, char *file)
 
 	if (remove(path)) {
 		if (ENOENT == errno)
-		fail:	send_msg(ctrl->sd, "550 No such file or directory.\r\n");
+		fail:	send_msg(ctrl, "550 No such file or directory.\r\n");
 		else if (EPERM == errno)
-			send_msg(ctrl->sd, "550 Not allowed to remove file or directory.\r\n");
+			send_msg(ctrl, "550 Not allowed to remove file or directory.\r\n");
 		else if (ENOTEMPTY == errno)
-			send_msg(ctrl->sd, "550 Not allowed to remove directory, not empty.\r\n");
+			send_msg(ctrl, "550 Not allowed to remove directory, not empty.\r\n");
 		else
-			send_msg(ctrl->sd, "550 Unknown error.\r\n");
+			send_msg(ctrl, "550 Unknown error.\r\n");
 		return;
 	}
 
 	LOG("User %s from %s deleted %s", ctrl->name, ctrl->clientaddr, file);
-	send_msg(ctrl->sd, "200 Command OK\r\n");
+	send_msg(ctrl, "200 Command OK\r\n");
 }
 
 static void handle_MKD(ctrl_t *ctrl, char *arg)
 {
+	char rpath[PATH_MAX];
 	char *path;
 
-	path = compose_abspath(ctrl, arg);
+	fcache_flush(ctrl);
+
+	path = compose_abspath(ctrl, arg, rpath, sizeof(rpath));
 	if (!path) {
 		INFO("MKD: invalid path to %s: %m", arg);
 		goto fail;
@@ -1425,14 +2210,14 @@ static void handle_MKD(ctrl_t *ctrl, char *arg)
 
 	if (mkdir(path, 0755)) {
 		if (EPERM == errno)
-		fail:	send_msg(ctrl->sd, "550 Not allowed to create directory.\r\n");
+		fail:	send_msg(ctrl, "550 Not allowed to create directory.\r\n");
 		else
-			send_msg(ctrl->sd, "550 Unknown error.\r\n");
+			send_msg(ctrl, "550 Unknown error.\r\n");
 		return;
 	}
 
 	LOG("User %s from %s created directory %s", ctrl->name, ctrl->clientaddr, arg);
-	send_msg(ctrl->sd, "200 Command OK\r\n");
+	send_msg(ctrl, "200 Command OK\r\n");
 }
 
 static void handle_RMD(ctrl_t *ctrl, char *arg)
@@ -1446,68 +2231,192 @@ static void handle_REST(ctrl_t *ctrl, char *arg)
 	char buf[80];
 
 	if (!string_valid(arg)) {
-		send_msg(ctrl->sd, "550 Invalid argument.\r\n");
+		send_msg(ctrl, "550 Invalid argument.\r\n");
 		return;
 	}
 
 	ctrl->offset = strtonum(arg, 0, INT64_MAX, &errstr);
 	snprintf(buf, sizeof(buf), "350 Restarting at %ld.  Send STOR or RETR to continue transfer.\r\n", ctrl->offset);
-	send_msg(ctrl->sd, buf);
+	send_msg(ctrl, buf);
 }
 
-static size_t num_nl(char *file)
+static size_t num_nl(int fd)
 {
-	FILE *fp;
-	char buf[80];
-	size_t len, num = 0;
-
-	fp = fopen(file, "r");
-	if (!fp)
-		return 0;
+	char buf[BUFFER_SIZE];
+	size_t num = 0;
+	off_t pos = 0;
+	ssize_t len;
 
-	do {
-		char *ptr = buf;
+	while ((len = pread(fd, buf, sizeof(buf), pos)) > 0) {
+		char *ptr = buf, *end = buf + len;
 
-		len = fread(buf, sizeof(char), sizeof(buf) - 1, fp);
-		if (len > 0) {
-			buf[len] = 0;
-			while ((ptr = strchr(ptr, '\n'))) {
-				ptr++;
-				num++;
-			}
+		while ((ptr = memchr(ptr, '\n', end - ptr))) {
+			ptr++;
+			num++;
 		}
-	} while (len > 0);
-	fclose(fp);
+		pos += len;
+	}
 
 	return num;
 }
 
 static void handle_SIZE(ctrl_t *ctrl, char *file)
 {
-	char *path;
 	char buf[80];
 	size_t extralen = 0;
 	struct stat st;
+	int fd, readable;
 
-	path = compose_abspath(ctrl, file);
-	if (!path || stat(path, &st) || S_ISDIR(st.st_mode)) {
-		send_msg(ctrl->sd, "550 No such file, or argument is a directory.\r\n");
+	fd = fcache_stat(ctrl, file, &st, &readable);
+	if (fd < 0 || S_ISDIR(st.st_mode)) {
+		send_msg(ctrl, "550 No such file, or argument is a directory.\r\n");
 		return;
 	}
 
-	DBG("SIZE %s", path);
+	DBG("SIZE %s", file);
+
+	/* Reading all of a big file would hold up all sessions */
+	if (ctrl->type == TYPE_A && do_single && st.st_size > SIZE_ASCII_MAX) {
+		send_msg(ctrl, "550 SIZE not allowed in ASCII mode.\r\n");
+		return;
+	}
 
-	if (ctrl->type == TYPE_A)
-		extralen = num_nl(path);
+	if (ctrl->type == TYPE_A && readable)
+		extralen = num_nl(fd);
 
 	snprintf(buf, sizeof(buf), "213 %"  PRIu64 "\r\n", (uint64_t)(st.st_size + extralen));
-	send_msg(ctrl->sd, buf);
+	send_msg(ctrl, buf);
 }
 
 /* No operation - used as session keepalive by clients. */
 static void handle_NOOP(ctrl_t *ctrl, char *arg)
 {
-	send_msg(ctrl->sd, "200 NOOP OK.\r\n");
+	send_msg(ctrl, "200 NOOP OK.\r\n");
+}
+
+static void stat_session(ctrl_t *ctrl)
+{
+	char xfer[PATH_MAX + 64];
+
+	if (ctrl->fp && ctrl->file)
+		snprintf(xfer, sizeof(xfer), "Transfer of %s in progress, at %" PRIu64 " bytes",
+			 ctrl->file, (uint64_t)ftello(ctrl->fp));
+	else if (ctrl->d || ctrl->ls)
+		snprintf(xfer, sizeof(xfer), "Listing of %s in progress", ctrl->file ?: "");
+	else if (ctrl->data_sd > 0 || ctrl->data_listen_sd > 0)
+		snprintf(xfer, sizeof(xfer), "Data connection open");
+	else
+		snprintf(xfer, sizeof(xfer), "No data connection");
+
+	snprintf(ctrl->buf, ctrl->bufsz, "211-FTP server status:\r\n"
+		 " Connected to %s\r\n"
+		 " Logged in as %s\r\n"
+		 " Working directory %s\r\n"
+		 " TYPE: %s, MODE: %s\r\n"
+		 " %s\r\n"
+		 "211 End of status.\r\n",
+		 ctrl->clientaddr, ctrl->name[0] ? ctrl->name : "nobody",
+		 ctrl->cwd, ctrl->type == TYPE_A ? "ASCII" : "BINARY",
+		 ctrl->mode == MODE_B ? "Block" : "Stream", xfer);
+	send_msg(ctrl, ctrl->buf);
+}
+
+static void stat_done(ctrl_t *ctrl)
+{
+	dir_close(ctrl->stat_d);
+	ctrl->stat_d = NULL;
+	free(ctrl->stat_dir);
+	ctrl->stat_dir = NULL;
+}
+
+/*
+ * Next chunk of a STAT listing, lines are never split.  Chunks are made
+ * until one does not fit in the socket buffer, the rest when that has
+ * been sent, so a client not reading only ever has one chunk queued.
+ */
+static void stat_next(ctrl_t *ctrl)
+{
+	char buf[BUFFER_SIZE], file[PATH_MAX];
+	char mode = ctrl->list_mode;
+	char *name = NULL;
+
+	ctrl->list_mode = LISTMODE_LIST;
+	while (ctrl->stat_d && !ctrl->olen) {
+		size_t len = 0;
+
+		buf[0] = 0;
+		while (sizeof(buf) - len >= PATH_MAX / 4 && (name = dir_read(ctrl->stat_d))) {
+			if (!strcmp(name, ".") || !strcmp(name, ".."))
+				continue;
+
+			if ((size_t)snprintf(file, sizeof(file), "%s/%s", ctrl->stat_dir, name) >= sizeof(file))
+				continue;
+			if (list_printf(ctrl, &buf[len], sizeof(buf) - len, file, name))
+				continue;
+			len += strlen(&buf[len]);
+		}
+
+		if (!name) {
+			if (ctrl->stat_d->err)
+				strlcat(buf, "213 End of status, listing incomplete.\r\n", sizeof(buf));
+			else
+				strlcat(buf, "213 End of status.\r\n", sizeof(buf));
+			stat_done(ctrl);
+		}
+		if (send_msg(ctrl, buf))
+			stat_done(ctrl);
+	}
+	ctrl->list_mode = mode;
+}
+
+/*
+ * STAT without argument is the session status, with a path it is the
+ * same as LIST, only sent over the control connection.  Saves clients
+ * that support it setting up a data connection for small directories.
+ */
+static void handle_STAT(ctrl_t *ctrl, char *arg)
+{
+	char buf[BUFFER_SIZE], dir[PATH_MAX], rpath[PATH_MAX];
+	char mode = ctrl->list_mode;
+	char *path;
+	struct stat st;
+	size_t len;
+
+	if (!string_valid(arg)) {
+		stat_session(ctrl);
+		return;
+	}
+
+	arg = list_args(arg, NULL);
+	path = compose_path(ctrl, arg, rpath, sizeof(rpath));
+	if (!path || stat(path, &st)) {
+		INFO("%s: STAT: invalid path to %s: %m", ctrl->clientaddr, arg);
+		send_msg(ctrl, "550 No such file or directory.\r\n");
+		return;
+	}
+	strlcpy(dir, path, sizeof(dir));
+
+	len = snprintf(buf, sizeof(buf), "213-Status of %s:\r\n", arg[0] ? arg : ".");
+	if (S_ISDIR(st.st_mode)) {
+		ctrl->stat_d = dir_open(dir, list_sorted(LISTMODE_LIST));
+		ctrl->stat_dir = strdup(dir);
+		if (!ctrl->stat_d || !ctrl->stat_dir) {
+			INFO("%s: STAT: Failed reading directory %s: %m", ctrl->clientaddr, arg);
+			stat_done(ctrl);
+			send_msg(ctrl, "550 No such file or directory.\r\n");
+			return;
+		}
+
+		send_msg(ctrl, buf);
+		stat_next(ctrl);
+		return;
+	}
+
+	ctrl->list_mode = LISTMODE_LIST;
+	list_printf(ctrl, &buf[len], sizeof(buf) - len, dir, basename(dir));
+	ctrl->list_mode = mode;
+	strlcat(buf, "213 End of status.\r\n", sizeof(buf));
+	send_msg(ctrl, buf);
 }
 
 #if 0
@@ -1522,13 +2431,13 @@ static void handle_RNTO(ctrl_t *ctrl, char *arg)
 
 static void handle_QUIT(ctrl_t *ctrl, char *arg)
 {
-	send_msg(ctrl->sd, "221 Goodbye.\r\n");
-	uev_exit(ctrl->ctx);
+	send_msg(ctrl, "221 Goodbye.\r\n");
+	session_exit(ctrl);
 }
 
 static void handle_CLNT(ctrl_t *ctrl, char *arg)
 {
-	send_msg(ctrl->sd, "200 CLNT\r\n");
+	send_msg(ctrl, "200 CLNT\r\n");
 }
 
 static void handle_OPTS(ctrl_t *ctrl, char *arg)
@@ -1557,9 +2466,9 @@ static void handle_OPTS(ctrl_t *ctrl, char *arg)
 
 		DBG("New MLSD facts: %s", facts);
 		strlcpy(ctrl->facts, facts, sizeof(ctrl->facts));
-		send_msg(ctrl->sd, buf);
+		send_msg(ctrl, buf);
 	} else
-		send_msg(ctrl->sd, "200 UTF8 OPTS ON\r\n");
+		send_msg(ctrl, "200 UTF8 OPTS ON\r\n");
 }
 
 static void handle_HELP(ctrl_t *ctrl, char *arg)
@@ -1569,7 +2478,7 @@ static void handle_HELP(ctrl_t *ctrl, char *arg)
 	int i = 0;
 
 	if (string_valid(arg) && !string_compare(arg, "SITE")) {
-		send_msg(ctrl->sd, "500 command HELP does not take any arguments on this server.\r\n");
+		send_msg(ctrl, "500 command HELP does not take any arguments on this server.\r\n");
 		return;
 	}
 
@@ -1583,7 +2492,7 @@ static void handle_HELP(ctrl_t *ctrl, char *arg)
 	snprintf(buf, sizeof(buf), "\r\n214 Help OK.\r\n");
 	strlcat(ctrl->buf, buf, ctrl->bufsz);
 
-	send_msg(ctrl->sd, ctrl->buf);
+	send_msg(ctrl, ctrl->buf);
 }
 
 static void handle_FEAT(ctrl_t *ctrl, char *arg)
@@ -1596,7 +2505,7 @@ static void handle_FEAT(ctrl_t *ctrl, char *arg)
 		 " REST STREAM\r\n"
 		 " MLST modify*;perm*;size*;type*;\r\n"
 		 "211 End\r\n");
-	send_msg(ctrl->sd, ctrl->buf);
+	send_msg(ctrl, ctrl->buf);
 }
 
 static void handle_UNKNOWN(ctrl_t *ctrl, char *command)
@@ -1604,7 +2513,7 @@ static void handle_UNKNOWN(ctrl_t *ctrl, char *command)
 	char buf[128];
 
 	snprintf(buf, sizeof(buf), "500 command '%s' not recognized by server.\r\n", command);
-	send_msg(ctrl->sd, buf);
+	send_msg(ctrl, buf);
 }
 
 #define COMMAND(NAME) { #NAME, handle_ ## NAME }
@@ -1616,6 +2525,7 @@ static ftp_cmd_t supported[] = {
 	COMMAND(PASS),
 	COMMAND(SYST),
 	COMMAND(TYPE),
+	COMMAND(MODE),
 	COMMAND(PORT),
 	COMMAND(EPRT),
 	COMMAND(RETR),
@@ -1637,82 +2547,293 @@ static ftp_cmd_t supported[] = {
 	COMMAND(CWD),
 	COMMAND(CDUP),
 	COMMAND(SIZE),
+	COMMAND(STAT),
 	COMMAND(NOOP),
 	COMMAND(HELP),
 	COMMAND(FEAT),
 	{ NULL, NULL }
 };
 
+/*
+ * No command is longer than four characters, so each fits in a 32-bit
+ * word, and a multiply and shift of that word is the slot in cmd_hash[].
+ * CMD_HASH_MULT was searched for offline so that none of the commands in
+ * supported[] collide, making dispatch a single compare of the word in
+ * that slot.  A new command may collide, if so we warn and fall back to
+ * walking supported[] until the multiplier is updated.
+ */
+static ftp_cmd_t *cmd_hash[1 << CMD_HASH_BITS];
+static uint32_t   cmd_word[1 << CMD_HASH_BITS];
+static int        cmd_linear = -1;
+
+/* Commands are upper case already, 0 if too long to be one */
+static uint32_t command_word(const char *command)
+{
+	uint32_t word = 0;
+	int i;
+
+	for (i = 0; i < 4 && command[i]; i++)
+		word |= (uint32_t)(uint8_t)command[i] << (24 - 8 * i);
+	if (command[i])
+		return 0;
+
+	return word;
+}
+
+static uint32_t command_hash(uint32_t word)
+{
+	return (uint32_t)(word * CMD_HASH_MULT) >> (32 - CMD_HASH_BITS);
+}
+
+static void hash_commands(void)
+{
+	ftp_cmd_t *cmd;
+
+	if (cmd_linear != -1)
+		return;
+
+	cmd_linear = 0;
+	for (cmd = &supported[0]; cmd->command; cmd++) {
+		uint32_t word = command_word(cmd->command);
+		uint32_t i = command_hash(word);
+
+		if (!word || cmd_hash[i]) {
+			WARN(0, "FTP command %s collides with %s, update CMD_HASH_MULT",
+			     cmd->command, cmd_hash[i] ? cmd_hash[i]->command : "none");
+			cmd_linear = 1;
+			return;
+		}
+
+		cmd_hash[i] = cmd;
+		cmd_word[i] = word;
+	}
+}
+
+static ftp_cmd_t *find_command(char *command)
+{
+	ftp_cmd_t *cmd;
+	uint32_t word, i;
+
+	if (cmd_linear) {
+		for (cmd = &supported[0]; cmd->command; cmd++) {
+			if (string_compare(command, cmd->command))
+				return cmd;
+		}
+		return NULL;
+	}
+
+	word = command_word(command);
+	i = command_hash(word);
+	if (!word || cmd_word[i] != word)
+		return NULL;
+
+	return cmd_hash[i];
+}
+
 static void child_exit(uev_t *w, void *arg, int events)
 {
 	DBG("Child exiting ...");
 	uev_exit(w->ctx);
 }
 
-static void read_client_command(uev_t *w, void *arg, int events)
+static void dispatch(ctrl_t *ctrl, char *line)
 {
 	char *command, *argument;
-	ctrl_t *ctrl = (ctrl_t *)arg;
+	uint64_t start;
 	ftp_cmd_t *cmd;
 
-	if (UEV_ERROR == events || UEV_HUP == events) {
-		uev_io_start(w);
+	parse_msg(line, &command, &argument);
+	if (!string_valid(command))
 		return;
+
+	start = stats_start();
+	PROBE3(cmd__start, ctrl, command, argument);
+	cmd = find_command(command);
+	if (cmd)
+		cmd->cb(ctrl, argument);
+	else
+		handle_UNKNOWN(ctrl, command);
+	/* Handlers reply in ctrl->buf, where command was, use the table */
+	PROBE2(cmd__done, ctrl, cmd ? cmd->command : NULL);
+	stats_command(start);
+}
+
+/* Transfer in progress, or waiting for its data connection */
+static int busy(ctrl_t *ctrl)
+{
+	return ctrl->file || ctrl->fp || ctrl->d || ctrl->ls || ctrl->pending != PENDING_NONE;
+}
+
+/* Commands served also during a transfer, the rest wait, RFC 959 */
+static int urgent(char *line, size_t len)
+{
+	char *commands[] = { "ABOR", "STAT", "QUIT" };
+
+	while (len > 0 && (uint8_t)*line >= 0xf0) {
+		line++;
+		len--;
 	}
 
-	/* Reset inactivity timer. */
-	uev_timer_set(&ctrl->timeout_watcher, INACTIVITY_TIMER, 0);
+	if (len < 5 || !strchr(" \r\n", line[4]))
+		return 0;
 
-	if (recv_msg(w->fd, ctrl->buf, ctrl->bufsz, &command, &argument)) {
-		DBG("Short read, exiting.");
-		uev_exit(ctrl->ctx);
-		return;
+	for (size_t i = 0; i < NELEMS(commands); i++) {
+		if (!strncasecmp(line, commands[i], 4))
+			return 1;
 	}
 
-	if (!string_valid(command))
-		return;
+	return 0;
+}
+
+/*
+ * Run all complete command lines received, in order.  Clients may send
+ * several at once, e.g. USER, PASS, TYPE, PASV and RETR, without waiting
+ * for the replies.  Lines after one starting a transfer are kept until
+ * it is done, transfer_free() then calls us again via the event loop.
+ * All lines are kept while replies wait to be sent, see send_msg().
+ */
+static void process(ctrl_t *ctrl)
+{
+	size_t pos = 0;
+
+	/* Until the session ends, see session_exit() */
+	while (uev_io_active(&ctrl->io_watcher) && !ctrl->olen && !ctrl->stat_d) {
+		char *line = &ctrl->rbuf[pos];
+		char *eol;
+		size_t len;
+
+		eol = memchr(line, '\n', ctrl->rlen - pos);
+		if (!eol)
+			break;
+		len = eol - line + 1;
+
+		if (busy(ctrl) && !urgent(line, len)) {
+			pos += len;
+			continue;
+		}
+
+		memcpy(ctrl->buf, line, len);
+		ctrl->buf[len] = 0;
+		ctrl->buf[strcspn(ctrl->buf, "\r\n")] = 0;
+
+		ctrl->rlen -= pos + len;
+		memmove(line, eol + 1, ctrl->rlen);
+		ctrl->rlen += pos;
+
+		dispatch(ctrl, ctrl->buf);
+		pos = 0;
+	}
+}
+
+/* Command buffer full, of lines process() has not been able to run yet */
+static int held_full(ctrl_t *ctrl)
+{
+	/* Save one byte for NUL termination in ctrl->buf */
+	return ctrl->rlen >= ctrl->bufsz - 1 && memchr(ctrl->rbuf, '\n', ctrl->rlen);
+}
+
+static void read_client_command(uev_t *w, void *arg, int events)
+{
+	ctrl_t *ctrl = (ctrl_t *)arg;
+	ssize_t bytes;
 
-	if (string_match(command, "FF F4")) {
-		DBG("Ignoring IAC command, client should send ABOR as well.");
+	if (UEV_ERROR == events || UEV_HUP == events) {
+		uev_io_start(w);
 		return;
 	}
 
-	for (cmd = &supported[0]; cmd->command; cmd++) {
-		if (string_compare(command, cmd->command)) {
-			cmd->cb(ctrl, argument);
+	/*
+	 * Room for queued replies, or woken up to run lines held back
+	 * during a transfer.  A STAT listing continues when all sent.
+	 */
+	if (events & UEV_WRITE) {
+		if (reply_flush(ctrl)) {
+			session_exit(ctrl);
+			return;
+		}
+		if (!ctrl->olen && ctrl->stat_d)
+			stat_next(ctrl);
+		if (!ctrl->olen)
+			uev_io_set(w, ctrl->sd, UEV_READ);
+	}
+
+	if ((events & UEV_READ) && !held_full(ctrl)) {
+		/* Reset inactivity timer. */
+		session_touch(ctrl);
+
+		/* A single line longer than the buffer */
+		if (ctrl->rlen >= ctrl->bufsz - 1) {
+			WARN(0, "Command line from %s too long, dropping it", ctrl->clientaddr);
+			send_msg(ctrl, "500 Command line too long.\r\n");
+			ctrl->rlen = 0;
+		}
+
+		bytes = recv(ctrl->sd, &ctrl->rbuf[ctrl->rlen], ctrl->bufsz - 1 - ctrl->rlen, 0);
+		if (bytes <= 0) {
+			if (bytes < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno))
+				return;
+
+			if (!bytes)
+				INFO("Client disconnected.");
+			else if (ECONNRESET == errno)
+				DBG("Connection reset by client.");
+			else
+				ERR(errno, "Failed reading client command");
+
+			DBG("Short read, exiting.");
+			session_exit(ctrl);
 			return;
 		}
+		ctrl->rlen += bytes;
 	}
 
-	handle_UNKNOWN(ctrl, command);
+	process(ctrl);
+
+	/*
+	 * Still full of lines held back during a transfer, or behind queued
+	 * replies, stop reading until they can run.  Woken up by a reply, or
+	 * by transfer_free(), the UEV_WRITE case above then runs them.
+	 */
+	if (uev_io_active(w) && held_full(ctrl))
+		uev_io_set(w, ctrl->sd, ctrl->olen ? UEV_WRITE : UEV_NONE);
 }
 
-static void ftp_command(ctrl_t *ctrl)
+static int ftp_command(ctrl_t *ctrl)
 {
 	uev_t sigterm_watcher;
 
 	ctrl->bufsz = BUFFER_SIZE * sizeof(char);
 	ctrl->buf   = malloc(ctrl->bufsz);
-	if (!ctrl->buf) {
+	ctrl->rbuf  = malloc(ctrl->bufsz);
+	if (!ctrl->buf || !ctrl->rbuf) {
                 WARN(errno, "FTP session failed allocating buffer");
-                exit(1);
+                return -1;
 	}
 
+	hash_commands();
+
+	/* Before the first reply, anything send_msg() queues is sent from it */
+	uev_io_init(ctrl->ctx, &ctrl->io_watcher, read_client_command, ctrl, ctrl->sd, UEV_READ);
+
 	snprintf(ctrl->buf, ctrl->bufsz, "220 %s (%s) ready.\r\n", prognm, VERSION);
-	send_msg(ctrl->sd, ctrl->buf);
+	send_msg(ctrl, ctrl->buf);
+
+	/* Sharing the event loop of the master, it calls uev_run() */
+	if (ctrl->shared)
+		return 0;
 
 	uev_signal_init(ctrl->ctx, &sigterm_watcher, child_exit, NULL, SIGTERM);
-	uev_io_init(ctrl->ctx, &ctrl->io_watcher, read_client_command, ctrl, ctrl->sd, UEV_READ);
-	uev_run(ctrl->ctx, 0);
+	return uev_run(ctrl->ctx, 0);
 }
 
 int ftp_session(uev_ctx_t *ctx, int sd)
 {
+	const int const_int_1 = 1;
 	int pid = 0;
 	ctrl_t *ctrl;
 	socklen_t len;
 
-	ctrl = new_session(ctx, sd, &pid);
+	ctrl = new_session(ctx, sd, 1, &pid);
 	if (!ctrl) {
 		if (pid < 0)
 			shutdown(sd, SHUT_RDWR);
@@ -1735,7 +2856,17 @@ int ftp_session(uev_ctx_t *ctx, int sd)
 	}
 	convert_address(&ctrl->client_sa, ctrl->clientaddr, sizeof(ctrl->clientaddr));
 
+	/*
+	 * Replies are sent whole, e.g. 150 then 226 right after a short
+	 * transfer, the second must not wait for the client's delayed ACK
+	 */
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &const_int_1, sizeof(const_int_1));
+
+	/* Telnet Synch before ABOR is urgent data, keep it in the stream */
+	setsockopt(sd, SOL_SOCKET, SO_OOBINLINE, &const_int_1, sizeof(const_int_1));
+
 	ctrl->type = TYPE_A;
+	ctrl->mode = MODE_S;
 	ctrl->data_listen_sd = -1;
 	ctrl->data_sd = -1;
 	ctrl->name[0] = 0;
@@ -1744,11 +2875,21 @@ int ftp_session(uev_ctx_t *ctx, int sd)
 	strlcpy(ctrl->facts, "mpst", sizeof(ctrl->facts));
 
 	INFO("Client connection from %s", ctrl->clientaddr);
-	ftp_command(ctrl);
+	if (ftp_command(ctrl))
+		goto fail;
+	if (ctrl->shared)
+		return 0;
 
 	DBG("Client exiting, bye");
 	exit(del_session(ctrl, 1));
 fail:
+	if (ctrl->shared) {
+		/* Only this session fails, not the master */
+		uev_timer_stop(&ctrl->timeout_watcher);
+		close(ctrl->timeout_watcher.fd);
+		del_session(ctrl, 1);
+		return -1;
+	}
 	free(ctrl);
 	shutdown(sd, SHUT_RDWR);
 	close(sd);
@@ -1758,6 +2899,7 @@ fail:
 	 * child instead of returning to the parent's accept loop, see the
 	 * rogue-listener explanation in new_session().  Issue #32.
 	 */
+	log_exit();
 	_exit(1);
 }
 
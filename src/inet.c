@@ -38,6 +38,20 @@ void inet_set_port(inet_addr_t *ss, in_port_t port)
 	((struct sockaddr_in *)ss)->sin_port = htons(port);
 }
 
+int inet_addr_equal(const inet_addr_t *a, const inet_addr_t *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+
+#ifdef ENABLE_IPV6
+	if (a->ss_family == AF_INET6)
+		return !memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+			       &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr));
+#endif
+	return ((const struct sockaddr_in *)a)->sin_addr.s_addr ==
+	       ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
 void inet_anyaddr(sa_family_t family, in_port_t port, inet_addr_t *ss)
 {
 	memset(ss, 0, sizeof(*ss));
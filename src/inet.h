@@ -31,6 +31,9 @@ in_port_t   inet_port(const inet_addr_t *ss);
 /* Set the port (host byte order) in the correct family-specific field */
 void        inet_set_port(inet_addr_t *ss, in_port_t port);
 
+/* Same address in @a and @b, ports are not compared */
+int         inet_addr_equal(const inet_addr_t *a, const inet_addr_t *b);
+
 /* Initialize @ss to the wildcard address of @family with @port */
 void        inet_anyaddr(sa_family_t family, in_port_t port, inet_addr_t *ss);
 
@@ -20,6 +20,36 @@
 
 int loglevel = LOG_NOTICE;
 
+/*
+ * Log messages are formatted straight into a per-process ring of slots
+ * and sent from there, without blocking.  Normally right away, but when
+ * syslogd, or the terminal or pipe on stdout, cannot keep up they stay
+ * queued and are sent from the event loop when the log is writable
+ * again, so a slow log never stalls a transfer.  When the ring is full
+ * new messages are dropped, and notice level and below are also limited
+ * to LOGBUF_RATE per second.  Dropped messages are counted and reported
+ * as soon as there is room again.
+ *
+ * Every process has a ring of its own, set up by log_init() after fork.
+ * Sessions are single threaded, so no locking is needed.
+ */
+typedef struct {
+	int    severity;
+	size_t len;
+	char   msg[LOGBUF_LINE];
+} logmsg_t;
+
+static logmsg_t   ring[LOGBUF_SLOTS];
+static unsigned   head, tail;	/* Next slot to fill, next to send */
+static unsigned   dropped;	/* Not yet reported */
+static time_t     rate_sec;
+static int        rate_num;
+
+static pid_t      pid;
+static int        logsd = -1;	/* syslogd socket */
+static uev_ctx_t *ctx;
+static uev_t      watcher;
+
 
 int loglvl(char *level)
 {
@@ -31,29 +61,213 @@ int loglvl(char *level)
 	return atoi(level);
 }
 
+static int log_connect(void)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, .sun_path = _PATH_LOG };
+
+	if (logsd < 0)
+		logsd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (logsd < 0)
+		return -1;
+
+	return connect(logsd, (struct sockaddr *)&sun, sizeof(sun));
+}
+
+static int sink(int severity)
+{
+	if (do_syslog)
+		return logsd;
+	if (severity > LOG_WARNING)
+		return STDOUT_FILENO;
+
+	return STDERR_FILENO;
+}
+
+/*
+ * Send queued messages, waiting at most @ms for each.  Returns -1 when
+ * all are sent, or the descriptor that would block.
+ */
+static int flush(int ms)
+{
+	while (tail != head) {
+		logmsg_t *m = &ring[tail % LOGBUF_SLOTS];
+		int fd = sink(m->severity);
+
+		/* The syslogd socket is non-blocking, stdout/stderr are not ours */
+		if (fd >= 0 && (ms || !do_syslog)) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+			if (poll(&pfd, 1, ms) == 0)
+				return fd;
+		}
+
+		if (fd >= 0 && write(fd, m->msg, m->len) < 0) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				return fd;
+
+			/* syslogd restarted?  Reconnect, unless chrooted away */
+			if (!do_syslog || log_connect() || write(fd, m->msg, m->len) < 0)
+				dropped++;
+		}
+		tail++;
+	}
+
+	return -1;
+}
+
+static void flush_cb(uev_t *w, void *arg, int events)
+{
+	int fd;
+
+	fd = flush(0);
+	if (fd < 0)
+		uev_io_stop(w);
+	else if (fd != w->fd)
+		uev_io_set(w, fd, UEV_WRITE);
+}
+
+/* Send what can be sent now, let the event loop send the rest */
+static void drain(void)
+{
+	int fd;
+
+	fd = flush(0);
+	if (fd < 0 || !ctx)
+		return;
+
+	if (uev_io_active(&watcher)) {
+		if (watcher.fd != fd)
+			uev_io_set(&watcher, fd, UEV_WRITE);
+		return;
+	}
+
+	uev_io_init(ctx, &watcher, flush_cb, NULL, fd, UEV_WRITE);
+}
+
+/* Next free slot, with the header for @severity, or NULL if full */
+static logmsg_t *slot(int severity)
+{
+	logmsg_t *m;
+
+	if (head - tail >= LOGBUF_SLOTS)
+		return NULL;
+
+	m = &ring[head % LOGBUF_SLOTS];
+	m->severity = severity;
+	m->len = 0;
+
+	if (do_syslog) {
+		time_t now = time(NULL);
+		char stamp[16];
+		struct tm tm;
+
+		strftime(stamp, sizeof(stamp), "%b %e %T", localtime_r(&now, &tm));
+		m->len = snprintf(m->msg, sizeof(m->msg), "<%d>%s %s[%d]: ",
+				  LOG_FTP | severity, stamp, prognm, pid);
+	} else if (loglevel == LOG_DEBUG)
+		m->len = snprintf(m->msg, sizeof(m->msg), "%d> ", pid);
+
+	return m;
+}
+
+static void commit(logmsg_t *m, int len)
+{
+	if (len < 0)
+		return;
+
+	m->len += len;
+	if (m->len >= sizeof(m->msg)) {
+		m->len = sizeof(m->msg) - 1;
+		if (!do_syslog)
+			m->msg[m->len - 1] = '\n';
+	}
+	head++;
+}
+
+/* Report dropped messages, if there is room for it and one more */
+static void report(void)
+{
+	logmsg_t *m;
+
+	if (!dropped || head - tail >= LOGBUF_SLOTS - 1)
+		return;
+
+	m = slot(LOG_WARNING);
+	commit(m, snprintf(m->msg + m->len, sizeof(m->msg) - m->len,
+			   "Log busy, dropped %u messages%s", dropped,
+			   do_syslog ? "" : "\n"));
+	stats_log_dropped(dropped);
+	dropped = 0;
+}
+
 void logit(int severity, const char *fmt, ...)
 {
-	FILE *file;
-        va_list args;
+	va_list args;
+	logmsg_t *m;
 
-	if (loglevel == INTERNAL_NOPRI)
+	if (loglevel == INTERNAL_NOPRI || severity > loglevel)
 		return;
 
-	if (severity > LOG_WARNING)
-		file = stdout;
-	else
-		file = stderr;
+	if (severity > LOG_WARNING) {
+		time_t now = clock_now();
 
-        va_start(args, fmt);
-	if (do_syslog)
-		vsyslog(severity, fmt, args);
-	else if (severity <= loglevel) {
-		if (loglevel == LOG_DEBUG)
-			fprintf(file, "%d> ", getpid());
-		vfprintf(file, fmt, args);
-		fflush(file);
+		if (now != rate_sec) {
+			rate_sec = now;
+			rate_num = 0;
+		}
+		if (++rate_num > LOGBUF_RATE) {
+			dropped++;
+			return;
+		}
 	}
-        va_end(args);
+
+	report();
+	m = slot(severity);
+	if (!m) {
+		dropped++;
+		drain();
+		return;
+	}
+
+	va_start(args, fmt);
+	commit(m, vsnprintf(m->msg + m->len, sizeof(m->msg) - m->len, fmt, args));
+	va_end(args);
+
+	drain();
+}
+
+/* Connect to syslogd, before chroot, see log_init() for the rest */
+void log_open(void)
+{
+	pid = getpid();
+	atexit(log_exit);
+
+	/* Retried on first message if syslogd is not up yet */
+	if (do_syslog)
+		log_connect();
+}
+
+/*
+ * Called by each new process, after fork, with its event loop.  Messages
+ * queued by the parent are the parent's to send, and its watcher is on
+ * another event loop.
+ */
+void log_init(uev_ctx_t *new_ctx)
+{
+	pid  = getpid();
+	head = tail = dropped = 0;
+	ctx  = new_ctx;
+	memset(&watcher, 0, sizeof(watcher));
+}
+
+/* At exit, wait a little for the log, then give up on it */
+void log_exit(void)
+{
+	if (head == tail && !dropped)
+		return;
+
+	report();
+	flush(LOGBUF_WAIT);
 }
 
 /**
@@ -0,0 +1,240 @@
+/* Pool of pre-opened PASV listening sockets, -o pasv_ports=MIN-MAX
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uftpd.h"
+
+/*
+ * The master opens one listening socket per port in the range, and per
+ * address family, before forking any session, so every session inherits
+ * all of them.  A session claims a port for a PASV/EPSV by setting its
+ * PID as owner, in shared memory, and gives it back after accepting the
+ * data connection.  Ports are handed out round-robin, so a port is not
+ * reused until the rest of the range has been.  The master clears the
+ * ports of sessions that exit, or crash, without giving them back.
+ *
+ * Pool sockets listen on all local addresses, and without SO_REUSEPORT,
+ * so no other process can bind the same ports.  A session only accepts
+ * a data connection on the address its control connection arrived on.
+ *
+ * Without the master, in inetd mode, each PASV binds a new socket to a
+ * free port in the range instead.
+ */
+typedef struct {
+	uint32_t next;		/* Round-robin */
+	pid_t    owner[];	/* Per family and port, 0: free */
+} ports_t;
+
+static ports_t *ports;
+static int     *socks;		/* Per family and port */
+static int      num;		/* Ports in range */
+
+static int family_index(sa_family_t family)
+{
+	return family == AF_INET6;
+}
+
+int pasv_init(void)
+{
+	sa_family_t family[] = { AF_INET, AF_INET6 };
+	int i, j, okay = 0;
+
+	if (!pasv_min)
+		return 0;
+
+	num = pasv_max - pasv_min + 1;
+	if (num > PASV_PORTS_MAX) {
+		ERR(0, "Too many PASV ports, %d, max %d", num, PASV_PORTS_MAX);
+		return 1;
+	}
+
+	ports = shm_alloc(sizeof(ports_t) + 2 * num * sizeof(pid_t));
+	socks = malloc(2 * num * sizeof(int));
+	if (!ports || !socks) {
+		ERR(errno, "Failed allocating PASV port pool");
+		return 1;
+	}
+
+	/* Each socket is a descriptor in every session */
+	nofile();
+
+	for (i = 0; i < 2; i++) {
+#ifndef ENABLE_IPV6
+		if (family[i] == AF_INET6) {
+			for (j = 0; j < num; j++)
+				socks[i * num + j] = -1;
+			continue;
+		}
+#endif
+		for (j = 0; j < num; j++) {
+			int sd;
+
+			sd = open_socket(family[i], pasv_min + j, SOCK_STREAM, 0, "PASV");
+			if (sd >= 0)
+				okay++;
+			socks[i * num + j] = sd;
+		}
+	}
+
+	if (!okay) {
+		ERR(0, "Failed opening any PASV port in range %d-%d", pasv_min, pasv_max);
+		return 1;
+	}
+
+	INFO("PASV port pool started, %d sockets on ports %d-%d", okay, pasv_min, pasv_max);
+
+	return 0;
+}
+
+/* Close connections left in the queue, e.g., by the previous owner */
+static void drain(int sd)
+{
+	int client;
+
+	while ((client = accept4(sd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || EINTR == errno)
+		if (client >= 0)
+			close(client);
+}
+
+static int claim(sa_family_t family)
+{
+	int base = family_index(family) * num;
+	uint32_t start;
+
+	start = __atomic_fetch_add(&ports->next, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < num; i++) {
+		int j = (start + i) % num;
+		pid_t none = 0;
+
+		if (socks[base + j] < 0)
+			continue;
+
+		if (__atomic_compare_exchange_n(&ports->owner[base + j], &none, getpid(), 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return base + j;
+	}
+
+	return -1;
+}
+
+/* Without a pool, bind a new socket to any free port in the range */
+static int bind_range(int sd, inet_addr_t *server)
+{
+	int range = pasv_max - pasv_min + 1;
+	int start = getpid() + time(NULL);
+
+	for (int i = 0; i < range; i++) {
+		inet_set_port(server, pasv_min + (start + i) % range);
+		if (!bind(sd, (struct sockaddr *)server, inet_len(server)))
+			return 0;
+		if (EADDRINUSE != errno)
+			break;
+	}
+
+	return -1;
+}
+
+/*
+ * Listening socket for a PASV/EPSV of @ctrl, from the pool or a new one.
+ * Returns -1 on error, with errno set, or EAGAIN if all ports are busy.
+ */
+int pasv_open(ctrl_t *ctrl)
+{
+	inet_addr_t server;
+	int sd;
+
+	if (ports) {
+		int i;
+
+		i = claim(ctrl->server_sa.ss_family);
+		if (i < 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		ctrl->data_pool = i;
+		drain(socks[i]);
+		DBG("Claimed PASV port %d", pasv_min + i % num);
+
+		return socks[i];
+	}
+
+	sd = socket(ctrl->server_sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sd < 0)
+		return -1;
+
+	/* Listen on the same local address the control channel arrived on */
+	memcpy(&server, &ctrl->server_sa, sizeof(server));
+	inet_set_port(&server, 0);
+	if (pasv_min) {
+		if (bind_range(sd, &server))
+			goto fail;
+	} else if (bind(sd, (struct sockaddr *)&server, inet_len(&server)) < 0)
+		goto fail;
+
+	if (listen(sd, 1) < 0)
+		goto fail;
+
+	return sd;
+fail:
+	close(sd);
+	return -1;
+}
+
+/* Close, or give back to the pool, the PASV listening socket of @ctrl */
+void pasv_close(ctrl_t *ctrl)
+{
+	int i = ctrl->data_pool;
+
+	if (ctrl->data_listen_sd <= 0)
+		return;
+
+	/* Still in our event loop, shared with other sessions with -o single */
+	if (ctrl->data_watcher.fd == ctrl->data_listen_sd)
+		uev_io_stop(&ctrl->data_watcher);
+
+	if (i >= 0) {
+		drain(socks[i]);
+		__atomic_store_n(&ports->owner[i], 0, __ATOMIC_RELEASE);
+		ctrl->data_pool = -1;
+	} else {
+		shutdown(ctrl->data_listen_sd, SHUT_RDWR);
+		close(ctrl->data_listen_sd);
+	}
+	ctrl->data_listen_sd = -1;
+}
+
+/* Called by the master for every child reaped, frees its ports */
+void pasv_reap(pid_t pid)
+{
+	if (!ports)
+		return;
+
+	for (int i = 0; i < 2 * num; i++) {
+		pid_t owner = pid;
+
+		if (__atomic_compare_exchange_n(&ports->owner[i], &owner, 0, 0,
+						__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			DBG("Freed PASV port %d of exited session %d", pasv_min + i % num, pid);
+	}
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
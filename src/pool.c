@@ -0,0 +1,356 @@
+/* Pool of pre-forked FTP session workers
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uftpd.h"
+
+/*
+ * Workers are forked ahead of time, chroot and drop privileges, then
+ * wait on the FTP listening sockets inherited from the master.  The one
+ * that wins accept() tells the master over a pipe and serves the client
+ * like any other session, exiting when done.  So no process ever serves
+ * more than one client, same as fork per connection, only the fork,
+ * chroot and privilege drop are done before the client connects.
+ *
+ * The master keeps at least prefork_min workers idle, when it drops
+ * below that it forks new ones up to prefork_max.  If workers keep dying
+ * before serving anyone, e.g. chroot fails, the pool is disabled and the
+ * master goes back to accepting and forking itself.
+ *
+ * With -o single the workers are session hosts instead, they never stop
+ * accepting and serve all their clients in one event loop, see the
+ * shared sessions in new_session().  Dead hosts are replaced the same
+ * way as idle workers.  With -o shards each host has a listener of its
+ * own, per address family, an SO_REUSEPORT socket the kernel balances
+ * connections over, so hosts never compete for the same client.
+ */
+
+static uev_t   status_watcher;
+static int     status_fd[2] = { -1, -1 };
+
+static uev_t  *listeners;	/* With shards, listener i is shard i % shards */
+static int     num_listeners;
+
+static pid_t  *idle;		/* Workers waiting for a client, hosts by slot */
+static int     num_idle;
+static int     failures;	/* Workers dying while idle, in a row */
+
+/* Worker side */
+static int     client = -1;
+
+/* Tell the master we are busy, so it can fork a replacement */
+static void busy(void)
+{
+	pid_t pid = getpid();
+
+	if (write(status_fd[1], &pid, sizeof(pid)) != sizeof(pid))
+		WARN(errno, "Failed notifying master of new FTP session");
+	close(status_fd[1]);
+	status_fd[1] = -1;
+}
+
+static void worker_accept(uev_t *w, void *arg, int events)
+{
+	int sd;
+
+	clock_update();
+
+	if (UEV_ERROR == events || UEV_HUP == events) {
+		uev_exit(w->ctx);
+		return;
+	}
+
+	while (1) {
+		sd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sd < 0) {
+			if (ECONNABORTED == errno || EINTR == errno)
+				continue;
+
+			/* Another worker was faster, or queue drained */
+			if (EAGAIN != errno && EWOULDBLOCK != errno)
+				WARN(errno, "Failed accepting FTP client connection");
+			return;
+		}
+
+		/* Session hosts drain the queue, workers take one client */
+		if (!do_single)
+			break;
+
+		if (status_fd[1] != -1)
+			busy();
+		ftp_session(w->ctx, sd);
+	}
+
+	client = sd;
+	uev_exit(w->ctx);
+}
+
+static void worker_exit(uev_t *w, void *arg, int events)
+{
+	uev_exit(w->ctx);
+}
+
+/* Pin host to the slot:th CPU we may run on, see reuseport_steer() */
+static void pin(int slot)
+{
+	cpu_set_t set;
+	int cpu, n = 0, nth;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return;
+
+	nth = slot % CPU_COUNT(&set);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &set) || n++ < nth)
+			continue;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set))
+			WARN(errno, "Failed pinning FTP session host to CPU %d", cpu);
+		else
+			DBG("FTP session host %d pinned to CPU %d", slot, cpu);
+		break;
+	}
+}
+
+static int mine(int i, int slot)
+{
+	return shards <= 0 || i % shards == slot;
+}
+
+static void worker(int slot)
+{
+	uev_t sigterm_watcher;
+	uev_ctx_t *ctx;
+	uev_t *w;
+	int i;
+
+	/* Same as for forked sessions, see new_session() */
+	setpgid(0, getppid());
+	forked = 1;
+	close(status_fd[0]);
+
+	ctx = calloc(1, sizeof(uev_ctx_t));
+	w = calloc(num_listeners, sizeof(uev_t));
+	if (!ctx || !w) {
+		ERR(errno, "Failed allocating FTP worker context");
+		log_exit();
+		_exit(1);
+	}
+	uev_init(ctx);
+	log_init(ctx);
+
+	if (do_single)
+		nofile();
+	if (do_affinity && slot >= 0)
+		pin(slot);
+	if (session_init()) {
+		log_exit();
+		_exit(1);
+	}
+
+	for (i = 0; i < num_listeners; i++) {
+		if (mine(i, slot))
+			uev_io_init(ctx, &w[i], worker_accept, NULL, listeners[i].fd, UEV_READ);
+		else
+			close(listeners[i].fd);
+	}
+	uev_signal_init(ctx, &sigterm_watcher, worker_exit, NULL, SIGTERM);
+	uev_run(ctx, 0);
+
+	uev_signal_stop(&sigterm_watcher);
+	for (i = 0; i < num_listeners; i++) {
+		if (!mine(i, slot))
+			continue;
+		uev_io_stop(&w[i]);
+		close(listeners[i].fd);
+	}
+	free(w);
+
+	if (client < 0) {
+		log_exit();
+		_exit(0);
+	}
+
+	busy();
+	ftp_session(ctx, client);
+	log_exit();
+	_exit(1);
+}
+
+/* Master side, session hosts keep their slot, workers take any */
+static int spawn(int slot)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		ERR(errno, "Failed forking FTP worker");
+		return -1;
+	}
+	if (!pid)
+		worker(slot);
+
+	idle[slot >= 0 ? slot : num_idle] = pid;
+	num_idle++;
+
+	return 0;
+}
+
+/* Top up when below the low water mark, to max, to fork in batches */
+static void fill(void)
+{
+	if (do_single) {
+		for (int i = 0; i < prefork_max; i++) {
+			if (!idle[i] && spawn(i))
+				break;
+		}
+		return;
+	}
+
+	if (num_idle >= prefork_min)
+		return;
+
+	while (num_idle < prefork_max) {
+		if (spawn(-1))
+			break;
+	}
+}
+
+static int forget(pid_t pid)
+{
+	for (int i = 0; i < prefork_max; i++) {
+		if (!pid || idle[i] != pid)
+			continue;
+
+		num_idle--;
+		if (do_single) {
+			idle[i] = 0;
+		} else {
+			idle[i] = idle[num_idle];
+			idle[num_idle] = 0;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+static void status_cb(uev_t *w, void *arg, int events)
+{
+	pid_t pid;
+
+	clock_update();
+	while (read(w->fd, &pid, sizeof(pid)) == sizeof(pid)) {
+		/* Session hosts keep accepting, only proves they work */
+		if (do_single) {
+			DBG("FTP session host %d serving clients", pid);
+			failures = 0;
+			continue;
+		}
+
+		DBG("FTP worker %d busy, %d idle", pid, num_idle - 1);
+		if (forget(pid))
+			failures = 0;
+	}
+
+	fill();
+}
+
+static void pool_exit(void)
+{
+	for (int i = 0; i < prefork_max; i++) {
+		if (idle[i])
+			kill(idle[i], SIGTERM);
+	}
+	num_idle = 0;
+	free(idle);
+	idle = NULL;
+
+	uev_io_stop(&status_watcher);
+	close(status_fd[0]);
+
+	/* Back to accepting in the master, fork per connection */
+	for (int i = 0; i < num_listeners; i++)
+		uev_io_start(&listeners[i]);
+}
+
+/* Called by the master for every child reaped */
+void pool_reap(pid_t pid)
+{
+	if (!idle || !forget(pid))
+		return;
+
+	if (++failures < POOL_FAILURES) {
+		fill();
+		return;
+	}
+
+	ERR(0, "FTP workers exit before serving any client, disabling pool.");
+	pool_exit();
+}
+
+/* Start pool of workers sharing the given, already started, listeners */
+int pool_init(uev_ctx_t *ctx, uev_t *w, int num)
+{
+	if (do_single) {
+		/* Fixed number of session hosts, one by default */
+		if (shards > 0)
+			prefork_min = shards;
+		else if (prefork_min <= 0)
+			prefork_min = 1;
+		prefork_max = prefork_min;
+	}
+
+	if (prefork_min <= 0 || num <= 0)
+		return 0;
+
+	if (prefork_max < prefork_min)
+		prefork_max = prefork_min;
+
+	idle = calloc(prefork_max, sizeof(pid_t));
+	if (!idle || pipe2(status_fd, O_NONBLOCK)) {
+		ERR(errno, "Failed setting up FTP worker pool");
+		free(idle);
+		idle = NULL;
+		return 1;
+	}
+
+	listeners = w;
+	num_listeners = num;
+	for (int i = 0; i < num; i++)
+		uev_io_stop(&listeners[i]);
+
+	uev_io_init(ctx, &status_watcher, status_cb, NULL, status_fd[0], UEV_READ);
+	fill();
+
+	if (shards > 0)
+		INFO("FTP session hosts started, %d shards", prefork_min);
+	else if (do_single)
+		INFO("FTP session hosts started, %d processes", prefork_min);
+	else
+		INFO("FTP worker pool started, %d-%d idle workers", prefork_min, prefork_max);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,63 @@
+/* USDT probes, for bpftrace et al, see configure --enable-usdt
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef UFTPD_PROBE_H_
+#define UFTPD_PROBE_H_
+
+#include "config.h"
+
+/*
+ * Static probes in the uftpd provider, a double underscore in the name
+ * is a dash to the tracer, e.g., usdt:/usr/sbin/uftpd:uftpd:cmd-start
+ *
+ *   session__start   ctrl, isftp, sd   session set up, in new_session()
+ *   session__done    ctrl, isftp       session ended, in del_session()
+ *   cmd__start       ctrl, cmd, arg    FTP command, before its handler
+ *   cmd__done        ctrl, cmd         FTP command, after its handler,
+ *                                      NULL if unknown to us
+ *   retr__chunk      ctrl, bytes       chunk of a RETR sent
+ *   stor__chunk      ctrl, bytes       chunk of a STOR written
+ *   tftp__data       ctrl, block, len  TFTP DATA sent
+ *   tftp__ack        ctrl, block       TFTP ACK received
+ *   tftp__retrans    ctrl, block       TFTP DATA resent
+ *
+ * DATA blocks are numbered from 1 in the file, they do not wrap like the
+ * 16-bit block number on the wire does after 65535.  An ACK has the block
+ * number from the wire.
+ *
+ * A probe is a single nop in the code until a tracer attaches to it,
+ * so arguments must be values at hand, never something computed only
+ * for the probe.  Without --enable-usdt they are not compiled in.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b)       DTRACE_PROBE2(uftpd, name, a, b)
+#define PROBE3(name, a, b, c)    DTRACE_PROBE3(uftpd, name, a, b, c)
+#else
+#define PROBE2(name, a, b)       do { } while (0)
+#define PROBE3(name, a, b, c)    do { } while (0)
+#endif
+
+#endif /* UFTPD_PROBE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
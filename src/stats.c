@@ -0,0 +1,318 @@
+/* Shared counters and histograms, -o stats=PATH in Prometheus text format
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uftpd.h"
+
+/*
+ * The master maps the counters in shared memory before the first fork,
+ * so every session, forked, pre-forked or hosted, updates the same ones
+ * with relaxed atomic adds, no locks and no messages to the master.
+ *
+ * The master listens on a Unix stream socket at PATH, each client that
+ * connects gets a snapshot in Prometheus text exposition format and is
+ * then disconnected, e.g., `nc -U PATH`.  Counters are read one by one,
+ * so a snapshot taken during a transfer may be off by that transfer.
+ *
+ * A session killed before it gets to del_session(), e.g., by SIGKILL,
+ * is never subtracted from the active sessions.
+ */
+
+enum { PROTO_FTP, PROTO_TFTP, PROTOS };
+enum { DIR_DOWNLOAD, DIR_UPLOAD, DIRS };
+
+/* Upper bounds of histogram buckets, +Inf bucket is implicit */
+static const uint64_t rate_bounds[] = {	/* bytes/sec */
+	10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+static const uint64_t latency_bounds[] = { /* usec */
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+
+#define STATS_BUCKETS  (NELEMS(latency_bounds) + 1)	/* Of the longest */
+
+typedef struct {
+	uint64_t bucket[STATS_BUCKETS];	/* Not cumulative, last is +Inf */
+	uint64_t sum;
+} histogram_t;
+
+typedef struct {
+	int64_t     active[PROTOS];
+	uint64_t    sessions[PROTOS];
+	uint64_t    transfers[PROTOS][DIRS][2];	/* Aborted, completed */
+	uint64_t    bytes[PROTOS][DIRS];
+	uint64_t    replies[4];			/* 2xx - 5xx */
+	uint64_t    log_dropped;
+	histogram_t rate;
+	histogram_t latency;
+} stats_t;
+
+static stats_t *stats;
+static uev_t    stats_watcher;
+static char    *stats_path;
+
+static void add(uint64_t *counter, uint64_t val)
+{
+	__atomic_fetch_add(counter, val, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void observe(histogram_t *h, const uint64_t *bounds, size_t num, uint64_t val)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (val <= bounds[i])
+			break;
+	}
+
+	add(&h->bucket[i], 1);
+	add(&h->sum, val);
+}
+
+static void histogram(FILE *fp, char *name, char *help, histogram_t *h,
+		      const uint64_t *bounds, size_t num, double scale)
+{
+	uint64_t count = 0;
+
+	fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (size_t i = 0; i < num; i++) {
+		count += get(&h->bucket[i]);
+		fprintf(fp, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", name, bounds[i] / scale, count);
+	}
+	count += get(&h->bucket[num]);
+	fprintf(fp, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+	fprintf(fp, "%s_sum %.6f\n%s_count %" PRIu64 "\n", name, get(&h->sum) / scale, name, count);
+}
+
+static void render(FILE *fp)
+{
+	const char *proto[] = { "ftp", "tftp" };
+	const char *dir[]   = { "download", "upload" };
+	int i, j, k;
+
+	fprintf(fp, "# HELP uftpd_sessions_active Sessions being served.\n"
+		"# TYPE uftpd_sessions_active gauge\n");
+	for (i = 0; i < PROTOS; i++)
+		fprintf(fp, "uftpd_sessions_active{proto=\"%s\"} %" PRId64 "\n", proto[i],
+			__atomic_load_n(&stats->active[i], __ATOMIC_RELAXED));
+
+	fprintf(fp, "# HELP uftpd_sessions_total Sessions served.\n"
+		"# TYPE uftpd_sessions_total counter\n");
+	for (i = 0; i < PROTOS; i++)
+		fprintf(fp, "uftpd_sessions_total{proto=\"%s\"} %" PRIu64 "\n", proto[i],
+			get(&stats->sessions[i]));
+
+	fprintf(fp, "# HELP uftpd_transfers_total File transfers, completed or aborted.\n"
+		"# TYPE uftpd_transfers_total counter\n");
+	for (i = 0; i < PROTOS; i++) {
+		for (j = 0; j < DIRS; j++) {
+			for (k = 0; k < 2; k++)
+				fprintf(fp, "uftpd_transfers_total{proto=\"%s\",direction=\"%s\",status=\"%s\"} %" PRIu64 "\n",
+					proto[i], dir[j], k ? "complete" : "aborted",
+					get(&stats->transfers[i][j][k]));
+		}
+	}
+
+	fprintf(fp, "# HELP uftpd_transfer_bytes_total Bytes of file data transferred.\n"
+		"# TYPE uftpd_transfer_bytes_total counter\n");
+	for (i = 0; i < PROTOS; i++) {
+		for (j = 0; j < DIRS; j++)
+			fprintf(fp, "uftpd_transfer_bytes_total{proto=\"%s\",direction=\"%s\"} %" PRIu64 "\n",
+				proto[i], dir[j], get(&stats->bytes[i][j]));
+	}
+
+	histogram(fp, "uftpd_transfer_rate_bytes_per_second", "Throughput of completed file transfers.",
+		  &stats->rate, rate_bounds, NELEMS(rate_bounds), 1);
+	histogram(fp, "uftpd_ftp_command_duration_seconds", "Time to handle an FTP command.",
+		  &stats->latency, latency_bounds, NELEMS(latency_bounds), 1000000);
+
+	fprintf(fp, "# HELP uftpd_ftp_replies_total Final FTP replies sent, one per command, by class.\n"
+		"# TYPE uftpd_ftp_replies_total counter\n");
+	for (i = 0; i < 4; i++)
+		fprintf(fp, "uftpd_ftp_replies_total{class=\"%dxx\"} %" PRIu64 "\n", i + 2,
+			get(&stats->replies[i]));
+
+	fprintf(fp, "# HELP uftpd_log_dropped_total Log messages dropped, log busy or rate limited.\n"
+		"# TYPE uftpd_log_dropped_total counter\n"
+		"uftpd_log_dropped_total %" PRIu64 "\n", get(&stats->log_dropped));
+}
+
+static void stats_cb(uev_t *w, void *arg, int events)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int sd;
+
+	if (UEV_ERROR == events || UEV_HUP == events) {
+		uev_io_stop(w);
+		return;
+	}
+
+	while (1) {
+		sd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sd < 0) {
+			if (ECONNABORTED == errno || EINTR == errno)
+				continue;
+			if (EAGAIN != errno && EWOULDBLOCK != errno)
+				WARN(errno, "Failed accepting stats client connection");
+			break;
+		}
+
+		if (!buf) {
+			fp = open_memstream(&buf, &len);
+			if (!fp) {
+				close(sd);
+				break;
+			}
+			render(fp);
+			fclose(fp);
+		}
+
+		/* A few kB, always fits in an empty socket buffer */
+		if (send(sd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+			DBG("Failed sending stats: %s", strerror(errno));
+		close(sd);
+	}
+
+	free(buf);
+}
+
+/* Map counters, and when @path is set start the endpoint, in the master */
+int stats_init(uev_ctx_t *ctx, char *path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	int sd;
+
+	if (!path)
+		return 0;
+
+	if (strlcpy(sa.sun_path, path, sizeof(sa.sun_path)) >= sizeof(sa.sun_path)) {
+		ERR(0, "Stats socket path %s too long", path);
+		return 1;
+	}
+
+	stats = shm_alloc(sizeof(stats_t));
+	if (!stats) {
+		ERR(errno, "Failed allocating shared stats");
+		return 1;
+	}
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		ERR(errno, "Failed creating stats socket");
+		return 1;
+	}
+
+	/* Left behind by a previous run */
+	unlink(path);
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) || listen(sd, LISTEN_BACKLOG)) {
+		ERR(errno, "Failed starting stats socket %s", path);
+		close(sd);
+		return 1;
+	}
+
+	uev_io_init(ctx, &stats_watcher, stats_cb, NULL, sd, UEV_READ);
+	stats_path = path;
+	INFO("Serving stats on %s ...", path);
+
+	return 0;
+}
+
+/* Called by the master when it exits */
+void stats_exit(void)
+{
+	if (!stats_path)
+		return;
+
+	uev_io_stop(&stats_watcher);
+	close(stats_watcher.fd);
+	unlink(stats_path);
+	stats_path = NULL;
+}
+
+/* Session started, @delta 1, or ended, -1 */
+void stats_session(int isftp, int delta)
+{
+	int i = isftp ? PROTO_FTP : PROTO_TFTP;
+
+	if (!stats)
+		return;
+
+	__atomic_fetch_add(&stats->active[i], delta, __ATOMIC_RELAXED);
+	if (delta > 0)
+		add(&stats->sessions[i], 1);
+}
+
+/* Transfer of @ctrl ended, @complete or aborted, after @us usec */
+void stats_transfer(ctrl_t *ctrl, int complete, uint64_t us)
+{
+	int i = ctrl->th ? PROTO_TFTP : PROTO_FTP;
+	int j = ctrl->xfer_dir == 'i' ? DIR_UPLOAD : DIR_DOWNLOAD;
+
+	if (!stats)
+		return;
+
+	add(&stats->transfers[i][j][!!complete], 1);
+	add(&stats->bytes[i][j], ctrl->xfer_bytes);
+	if (complete)
+		observe(&stats->rate, rate_bounds, NELEMS(rate_bounds),
+			ctrl->xfer_bytes * 1000000 / (us ?: 1));
+}
+
+/* Start of an FTP command, returns 0 when not collecting stats */
+uint64_t stats_start(void)
+{
+	return stats ? clock_usec() : 0;
+}
+
+/* FTP command, started at @start by stats_start(), handled */
+void stats_command(uint64_t start)
+{
+	if (!stats || !start)
+		return;
+
+	observe(&stats->latency, latency_bounds, NELEMS(latency_bounds), clock_usec() - start);
+}
+
+/* Final FTP reply with @code sent, counted by class */
+void stats_reply(int code)
+{
+	if (!stats || code < 200 || code >= 600)
+		return;
+
+	add(&stats->replies[code / 100 - 2], 1);
+}
+
+void stats_log_dropped(unsigned num)
+{
+	if (!stats)
+		return;
+
+	add(&stats->log_dropped, num);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
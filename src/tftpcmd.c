@@ -88,7 +88,10 @@ static int send_DATA(ctrl_t *ctrl, long block)
 
 	DBG("tftp block %ld reading %zd bytes ...", block, ctrl->segsize);
 	len = fread(ctrl->th->th_data, sizeof(char), ctrl->segsize, ctrl->fp);
+	if ((uint64_t)ftell(ctrl->fp) > ctrl->xfer_bytes)
+		ctrl->xfer_bytes = ftell(ctrl->fp);
 
+	PROBE3(tftp__data, ctrl, block, len);
 	return do_send(ctrl, len);
 }
 
@@ -180,7 +183,8 @@ static int parse_RWRQ(ctrl_t *ctrl, char *buf, size_t len)
 {
 	size_t opt_len = strlen(buf) + 1;
 
-	/* First opt is always filename */
+	/* First opt is always filename, again if the request is resent */
+	free(ctrl->file);
 	ctrl->file = strdup(buf);
 	if (!ctrl->file)
 		return send_ERROR(ctrl, EUNDEF, NULL);
@@ -220,19 +224,12 @@ static int parse_RWRQ(ctrl_t *ctrl, char *buf, size_t len)
 
 static int handle_RRQ(ctrl_t *ctrl)
 {
-	char *path;
-
-	path = compose_path(ctrl, ctrl->file);
-	if (!path) {
-		ERR(errno, "%s: Invalid path to file %s", ctrl->clientaddr, ctrl->file);
-		return send_ERROR(ctrl, ENOTFOUND, NULL);
-	}
-
-	ctrl->fp = fopen(path, "r");
+	ctrl->fp = fopen_path(ctrl, ctrl->file, "r");
 	if (!ctrl->fp) {
-		ERR(errno, "%s: Failed opening '%s'", ctrl->clientaddr, path);
+		ERR(errno, "%s: Failed opening '%s'", ctrl->clientaddr, ctrl->file);
 		return send_ERROR(ctrl, ENOTFOUND, NULL);
 	}
+	xferlog_start(ctrl, 'o');
 
 	/*
 	 * With negotiated options the OACK has already been sent.  Per RFC
@@ -247,8 +244,6 @@ static int handle_RRQ(ctrl_t *ctrl)
 
 static int handle_WRQ(ctrl_t *ctrl)
 {
-	char *path;
-
 	/*
 	 * A WRQ while a transfer is already open is a retransmission: the
 	 * client did not see our ACK/OACK.  Do NOT reopen the file, that
@@ -262,18 +257,14 @@ static int handle_WRQ(ctrl_t *ctrl)
 		return 0;
 	}
 
-	path = compose_path(ctrl, ctrl->file);
-	if (!path) {
-		ERR(errno, "%s: Invalid path to file %s", ctrl->clientaddr, ctrl->file);
-		return send_ERROR(ctrl, ENOTFOUND, NULL);
-	}
-
 	ctrl->offset = 1;	/* First expected block */
-	ctrl->fp = fopen(path, "w");
+	ctrl->fp = fopen_path(ctrl, ctrl->file, "w");
 	if (!ctrl->fp) {
-		ERR(errno, "%s: Failed opening '%s'", ctrl->clientaddr, path);
+		ERR(errno, "%s: Failed opening '%s'", ctrl->clientaddr, ctrl->file);
 		return send_ERROR(ctrl, ENOTFOUND, NULL);
 	}
+	xferlog_start(ctrl, 'i');
+	ctrl->xfer_offset = 0;
 
 	if (ctrl->tftp_options)
 		return 0;
@@ -301,6 +292,9 @@ static int handle_DATA(ctrl_t *ctrl, size_t len)
 	}
 
 	ctrl->offset++;
+	ctrl->xfer_bytes += len;
+	if (len < ctrl->segsize)
+		xferlog_done(ctrl, 1);
 	if (send_ACK(ctrl, block) || len < ctrl->segsize)
 		return 0;
 
@@ -310,10 +304,12 @@ static int handle_DATA(ctrl_t *ctrl, size_t len)
 /* TODO: Add support for ACK timeout and resend */
 static int handle_ACK(ctrl_t *ctrl, int block)
 {
+	PROBE2(tftp__ack, ctrl, block);
 	if (ctrl->fp) {
 		long acked, last;
 
 		if (feof(ctrl->fp)) {
+			xferlog_done(ctrl, 1);
 			fclose(ctrl->fp);
 			ctrl->fp = NULL;
 			return 0;
@@ -330,8 +326,11 @@ static int handle_ACK(ctrl_t *ctrl, int block)
 		acked = last - ((last - block) & 0xffff);
 		DBG("ACK block %d (abs %ld), last sent %ld ...", block, acked, last);
 
-		if (acked >= 1 && acked < last)
+		if (acked >= 1 && acked < last) {
+			ctrl->xfer_retrans++;
+			PROBE2(tftp__retrans, ctrl, acked + 1);
 			return !send_DATA(ctrl, acked + 1);
+		}
 
 		return !send_DATA(ctrl, 0);
 	}
@@ -349,7 +348,7 @@ static void read_client_command(uev_t *w, void *arg, int events)
 	socklen_t        addr_len = sizeof(ctrl->client_sa);
 
 	/* Reset inactivity timer. */
-	uev_timer_set(&ctrl->timeout_watcher, INACTIVITY_TIMER, 0);
+	session_touch(ctrl);
 
 	memset(ctrl->buf, 0, ctrl->bufsz);
 	len = recvfrom(ctrl->sd, ctrl->buf, ctrl->bufsz, 0, addr, &addr_len);
@@ -376,7 +375,6 @@ static void read_client_command(uev_t *w, void *arg, int events)
 		}
 		LOG("tftp RRQ '%s' from %s:%d", ctrl->file, ctrl->clientaddr, port);
 		active = handle_RRQ(ctrl);
-		free(ctrl->file);
 		break;
 
 	case WRQ:
@@ -388,7 +386,6 @@ static void read_client_command(uev_t *w, void *arg, int events)
 		}
 		LOG("tftp WRQ '%s' from %s:%d", ctrl->file, ctrl->clientaddr, port);
 		handle_WRQ(ctrl);
-		free(ctrl->file);
 		break;
 
 	case DATA:		/* Received data after WRQ */
@@ -434,7 +431,7 @@ int tftp_session(uev_ctx_t *ctx, int sd)
 	int pid = 0;
 	ctrl_t *ctrl;
 
-	ctrl = new_session(ctx, sd, &pid);
+	ctrl = new_session(ctx, sd, 0, &pid);
 	if (!ctrl)
 		return pid;
 
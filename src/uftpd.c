@@ -28,22 +28,32 @@ int   do_ftp      = FTP_DEFAULT_PORT;
 int   do_tftp     = TFTP_DEFAULT_PORT;
 char *pasv_addr   = NULL;
 int   do_insecure = 0;
-pid_t tftp_pid    = 0;
+int   list_cache  = 0;
+int   list_depth  = LIST_DEPTH;
+int   prefork_min = 0;
+int   prefork_max = 0;
+int   do_single   = 0;
+int   shards      = 0;
+int   do_affinity = 0;
+int   backlog     = LISTEN_BACKLOG;
+int   pasv_min    = 0;
+int   pasv_max    = 0;
+int   ftp_timeout = INACTIVITY_TIMER;
+int   tftp_timeout = INACTIVITY_TIMER;
 struct passwd *pw = NULL;
 
-/* Event contexts */
-static uev_t ftp_watcher;
-static uev_t tftp_watcher;
-#ifdef ENABLE_IPV6
-static uev_t  ftp6_watcher;
-static uev_t  tftp6_watcher;
-static pid_t  tftp6_pid = 0;
-#endif
+/* Event contexts, one listener per address family and shard */
+static uev_t *ftp_watchers;
+static int    num_ftp;
+static uev_t *tftp_watchers;
+static pid_t *tftp_pids;	/* Session serving each TFTP socket */
+static int    num_tftp;
 static uev_t sigchld_watcher;
 static uev_t sigterm_watcher;
 static uev_t sigint_watcher;
 static uev_t sighup_watcher;
 static uev_t sigquit_watcher;
+static char *stats_path;	/* -o stats=PATH */
 
 
 static int version(void)
@@ -71,9 +81,21 @@ static int usage(int code)
 		printf("  -n         Run in foreground, do not detach from controlling terminal\n"
 		       "  -o OPT     Options:\n"
 		       "                      ftp=PORT\n"
+		       "                      backlog=NUM\n"
+		       "                      ftp_timeout=SEC\n"
 		       "                      tftp=PORT\n"
+		       "                      tftp_timeout=SEC\n"
 		       "                      pasv_addr=ADDR\n"
+		       "                      pasv_ports=MIN-MAX\n"
 		       "                      writable\n"
+		       "                      list_cache=SLOTS\n"
+		       "                      list_depth=NUM\n"
+		       "                      prefork=MIN[-MAX]\n"
+		       "                      single\n"
+		       "                      shards[=NUM]\n"
+		       "                      affinity\n"
+		       "                      xferlog=FILE\n"
+		       "                      stats=PATH\n"
 		       "  -p FILE    File to store process ID for signaling %s\n"
 		       "  -s         Use syslog, even if running in foreground, default w/o -n\n",
 		       prognm);
@@ -89,6 +111,8 @@ static int usage(int code)
  */
 static void sigchld_cb(uev_t *w, void *arg, int events)
 {
+	clock_update();
+
 	while (1) {
 		pid_t pid;
 
@@ -96,19 +120,18 @@ static void sigchld_cb(uev_t *w, void *arg, int events)
 		if (pid <= 0)
 			break;
 
+		pool_reap(pid);
+		pasv_reap(pid);
+
 		/* TFTP client disconnected, we can now serve TFTP again! */
-		if (pid == tftp_pid) {
+		for (int i = 0; i < num_tftp; i++) {
+			if (pid != tftp_pids[i])
+				continue;
+
 			DBG("Previous TFTP session ended, restarting TFTP watcher ...");
-			tftp_pid = 0;
-			uev_io_start(&tftp_watcher);
+			tftp_pids[i] = 0;
+			uev_io_start(&tftp_watchers[i]);
 		}
-#ifdef ENABLE_IPV6
-		else if (pid == tftp6_pid) {
-			DBG("Previous TFTP/IPv6 session ended, restarting watcher ...");
-			tftp6_pid = 0;
-			uev_io_start(&tftp6_watcher);
-		}
-#endif
 	}
 }
 
@@ -191,30 +214,35 @@ static void ftp_cb(uev_t *w, void *arg, int events)
 {
         int client;
 
+	clock_update();
+
 	if (UEV_ERROR == events || UEV_HUP == events) {
 		uev_io_stop(w);
 		close(w->fd);
 		return;
 	}
 
-        client = accept(w->fd, NULL, NULL);
-        if (client < 0) {
-                WARN(errno, "Failed accepting FTP client connection");
-                return;
-        }
+	/* Drain the accept queue, a burst of clients costs one wakeup */
+	while (1) {
+		client = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client < 0) {
+			if (ECONNABORTED == errno || EINTR == errno)
+				continue;
+
+			if (EAGAIN != errno && EWOULDBLOCK != errno)
+				WARN(errno, "Failed accepting FTP client connection");
+			return;
+		}
 
-        ftp_session(arg, client);
+		ftp_session(arg, client);
+	}
 }
 
 static void tftp_cb(uev_t *w, void *arg, int events)
 {
-	pid_t *pidp = &tftp_pid;
-
-#ifdef ENABLE_IPV6
-	if (w == &tftp6_watcher)
-		pidp = &tftp6_pid;
-#endif
+	pid_t *pidp = &tftp_pids[w - tftp_watchers];
 
+	clock_update();
 	uev_io_stop(w);
 
 	if (UEV_ERROR == events || UEV_HUP == events) {
@@ -229,56 +257,102 @@ static void tftp_cb(uev_t *w, void *arg, int events)
 	}
 }
 
-static int start_service(uev_ctx_t *ctx, uev_t *w, uev_cb_t *cb, sa_family_t family, int port, int type, char *desc)
+/* Start @num listeners on @port, all or none, returns number started */
+static int start_service(uev_ctx_t *ctx, uev_t *w, uev_cb_t *cb, sa_family_t family, int port, int type, char *desc, int num)
 {
-	int sd;
+	int i, sd;
 
 	if (!port)
 		/* Disabled */
-		return 1;
+		return 0;
 
-	sd = open_socket(family, port, type, desc);
-	if (sd < 0) {
-		if (EACCES == errno)
-			WARN(0, "Not allowed to start %s service.%s",
-			     desc, port < 1024 ? "  Privileged port." : "");
-		return 1;
+	for (i = 0; i < num; i++) {
+		sd = open_socket(family, port, type, shards > 0, desc);
+		if (sd < 0) {
+			if (EACCES == errno)
+				WARN(0, "Not allowed to start %s service.%s",
+				     desc, port < 1024 ? "  Privileged port." : "");
+			while (i--) {
+				uev_io_stop(&w[i]);
+				close(w[i].fd);
+			}
+			return 0;
+		}
+
+		uev_io_init(ctx, &w[i], cb, ctx, sd, UEV_READ);
 	}
 
-	INFO("Starting %s server on port %d ...", desc, port);
-	uev_io_init(ctx, w, cb, ctx, sd, UEV_READ);
+	if (num > 1)
+		INFO("Starting %s server on port %d, %d shards ...", desc, port, num);
+	else
+		INFO("Starting %s server on port %d ...", desc, port);
+
+	return num;
+}
 
-	return 0;
+/* Start FTP listeners for @family, with CPU steering when pinned */
+static void start_ftp(uev_ctx_t *ctx, sa_family_t family, char *desc, int num)
+{
+	uev_t *w = &ftp_watchers[num_ftp];
+
+	if (!start_service(ctx, w, ftp_cb, family, do_ftp, SOCK_STREAM, desc, num))
+		return;
+	num_ftp += num;
+
+	if (do_affinity && num > 1 && reuseport_steer(w[0].fd, num))
+		WARN(errno, "Failed attaching %s reuseport CPU steering program", desc);
 }
 
 static int serve_files(uev_ctx_t *ctx)
 {
-	int ftp, tftp;
+	int num = shards > 0 ? shards : 1;
+	int rc;
+
+	/* Room for both address families */
+	ftp_watchers  = calloc(2 * num, sizeof(uev_t));
+	tftp_watchers = calloc(2 * num, sizeof(uev_t));
+	tftp_pids     = calloc(2 * num, sizeof(pid_t));
+	if (!ftp_watchers || !tftp_watchers || !tftp_pids) {
+		ERR(errno, "Failed allocating %d listeners", num);
+		return 1;
+	}
 
 	DBG("Starting services ...");
-	ftp  = start_service(ctx, &ftp_watcher,   ftp_cb, AF_INET, do_ftp, SOCK_STREAM, "FTP");
-	tftp = start_service(ctx, &tftp_watcher, tftp_cb, AF_INET, do_tftp, SOCK_DGRAM, "TFTP");
+	start_ftp(ctx, AF_INET, "FTP", num);
+	num_tftp += start_service(ctx, &tftp_watchers[num_tftp], tftp_cb, AF_INET, do_tftp, SOCK_DGRAM, "TFTP", num);
 #ifdef ENABLE_IPV6
 	/* Separate IPv6 listeners, kept distinct from the IPv4 ones */
-	if (!start_service(ctx, &ftp6_watcher,  ftp_cb,  AF_INET6, do_ftp,  SOCK_STREAM, "FTP/IPv6"))
-		ftp = 0;
-	if (!start_service(ctx, &tftp6_watcher, tftp_cb, AF_INET6, do_tftp, SOCK_DGRAM, "TFTP/IPv6"))
-		tftp = 0;
+	start_ftp(ctx, AF_INET6, "FTP/IPv6", num);
+	num_tftp += start_service(ctx, &tftp_watchers[num_tftp], tftp_cb, AF_INET6, do_tftp, SOCK_DGRAM, "TFTP/IPv6", num);
 #endif
 
 	/* Check if failed to start any service ... */
-	if (ftp && tftp)
+	if (!num_ftp && !num_tftp)
+		return 1;
+
+	/* Shared by all sessions, so must be set up before the first fork */
+	if (cache_init(list_cache))
+		return 1;
+	if (pasv_init())
+		return 1;
+	if (stats_init(ctx, stats_path))
 		return 1;
 
 	/* Setup signal callbacks */
 	sig_init(ctx);
 
+	/* Workers accept FTP clients themselves, on the shared listeners */
+	if (pool_init(ctx, ftp_watchers, num_ftp))
+		return 1;
+
 	/* We're now up and running, save pid file. */
 	pidfile(pidfn);
 
 	INFO("Serving files from %s ...", home);
+	rc = uev_run(ctx, 0);
+	stats_exit();
 
-	return uev_run(ctx, 0);
+	return rc;
 }
 
 static char *progname(char *arg0)
@@ -296,12 +370,25 @@ static char *progname(char *arg0)
 
 int main(int argc, char **argv)
 {
+	char *xferlog = NULL;
 	int c;
 	enum {
 		FTP_OPT = 0,
 		TFTP_OPT,
 		SEC_OPT,
-		PASV_OPT
+		PASV_OPT,
+		CACHE_OPT,
+		DEPTH_OPT,
+		PREFORK_OPT,
+		SINGLE_OPT,
+		SHARDS_OPT,
+		AFFINITY_OPT,
+		BACKLOG_OPT,
+		PORTS_OPT,
+		FTP_TIMEOUT_OPT,
+		TFTP_TIMEOUT_OPT,
+		XFERLOG_OPT,
+		STATS_OPT
 	};
 	char *subopts;
 	char *const token[] = {
@@ -309,6 +396,18 @@ int main(int argc, char **argv)
 		[TFTP_OPT] = "tftp",
 		[SEC_OPT]  = "writable",
 		[PASV_OPT] = "pasv_addr",
+		[CACHE_OPT] = "list_cache",
+		[DEPTH_OPT] = "list_depth",
+		[PREFORK_OPT] = "prefork",
+		[SINGLE_OPT] = "single",
+		[SHARDS_OPT] = "shards",
+		[AFFINITY_OPT] = "affinity",
+		[BACKLOG_OPT] = "backlog",
+		[PORTS_OPT] = "pasv_ports",
+		[FTP_TIMEOUT_OPT] = "ftp_timeout",
+		[TFTP_TIMEOUT_OPT] = "tftp_timeout",
+		[XFERLOG_OPT] = "xferlog",
+		[STATS_OPT] = "stats",
 		NULL
 	};
 	uev_ctx_t ctx;
@@ -367,6 +466,94 @@ int main(int argc, char **argv)
 					do_insecure = 1;
 					break;
 
+				case CACHE_OPT:
+					if (!value) {
+						fprintf(stderr, "Missing argument to -o list_cache=SLOTS\n");
+						return usage(1);
+					}
+					list_cache = atoi(value);
+					break;
+
+				case DEPTH_OPT:
+					if (!value) {
+						fprintf(stderr, "Missing argument to -o list_depth=NUM\n");
+						return usage(1);
+					}
+					list_depth = atoi(value);
+					break;
+
+				case PREFORK_OPT:
+					if (!value || sscanf(value, "%d-%d", &prefork_min, &prefork_max) < 1) {
+						fprintf(stderr, "Missing argument to -o prefork=MIN[-MAX]\n");
+						return usage(1);
+					}
+					break;
+
+				case SINGLE_OPT:
+					do_single = 1;
+					break;
+
+				case SHARDS_OPT:
+					if (value)
+						shards = atoi(value);
+					else
+						shards = sysconf(_SC_NPROCESSORS_ONLN);
+					if (shards < 1) {
+						fprintf(stderr, "Invalid argument to -o shards=NUM\n");
+						return usage(1);
+					}
+					do_single = 1;
+					break;
+
+				case AFFINITY_OPT:
+					do_affinity = 1;
+					break;
+
+				case BACKLOG_OPT:
+					if (!value || (backlog = atoi(value)) < 1) {
+						fprintf(stderr, "Invalid argument to -o backlog=NUM\n");
+						return usage(1);
+					}
+					break;
+
+				case PORTS_OPT:
+					if (!value || sscanf(value, "%d-%d", &pasv_min, &pasv_max) != 2 ||
+					    pasv_min < 1 || pasv_max < pasv_min || pasv_max > 65535) {
+						fprintf(stderr, "Invalid argument to -o pasv_ports=MIN-MAX\n");
+						return usage(1);
+					}
+					break;
+
+				case FTP_TIMEOUT_OPT:
+					if (!value || (ftp_timeout = atoi(value)) < 1) {
+						fprintf(stderr, "Invalid argument to -o ftp_timeout=SEC\n");
+						return usage(1);
+					}
+					break;
+
+				case TFTP_TIMEOUT_OPT:
+					if (!value || (tftp_timeout = atoi(value)) < 1) {
+						fprintf(stderr, "Invalid argument to -o tftp_timeout=SEC\n");
+						return usage(1);
+					}
+					break;
+
+				case XFERLOG_OPT:
+					if (!value) {
+						fprintf(stderr, "Missing argument to -o xferlog=FILE\n");
+						return usage(1);
+					}
+					xferlog = value;
+					break;
+
+				case STATS_OPT:
+					if (!value) {
+						fprintf(stderr, "Missing argument to -o stats=PATH\n");
+						return usage(1);
+					}
+					stats_path = value;
+					break;
+
 				default:
 					fprintf(stderr, "Unrecognized option '%s'\n", value);
 					return usage(1);
@@ -413,16 +600,24 @@ int main(int argc, char **argv)
 		do_syslog  = 1;
 	}
 
-	if (do_syslog) {
-		openlog(prognm, LOG_PID | LOG_NDELAY, LOG_FTP);
-		setlogmask(LOG_UPTO(loglevel));
-	}
+	/* Before chroot, syslogd is at /dev/log */
+	log_open();
+	if (xferlog && xferlog_open(xferlog))
+		return 1;
+
+	/*
+	 * Listings use the C locale's month names, and the time zone must
+	 * be read before sessions chroot away from /etc/localtime.
+	 */
+	setlocale(LC_TIME, "C");
+	tzset();
 
 	DBG("Initializing ...");
 	if (init(&ctx)) {
 		ERR(0, "Failed initializing, exiting.");
 		return 1;
 	}
+	log_init(&ctx);
 
 	if (inetd) {
 		int sd;
@@ -450,6 +645,7 @@ int main(int argc, char **argv)
 			ERR(errno, "Failed daemonizing");
 			return 1;
 		}
+		log_init(&ctx);
 	}
 
 	DBG("Serving files as PID %d ...", getpid());
@@ -30,6 +30,8 @@
 #include <locale.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pwd.h>
 #include <sched.h>
 #include <stdarg.h>
@@ -38,10 +40,13 @@
 #include <inttypes.h>		/*  PRIu64/PRI64, etc. for stdint.h types */
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>		/* isset(), setbit(), etc. */
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
@@ -55,6 +60,7 @@
 #endif
 
 #include "inet.h"
+#include "probe.h"
 
 #define FTP_DEFAULT_PORT  21
 #define FTP_SERVICE_NAME  "ftp"
@@ -67,10 +73,52 @@
 #define FTP_DEFAULT_USER  "ftp"
 #define FTP_DEFAULT_HOME  "/srv/ftp"
 
+#ifndef _PATH_LOG
+#define _PATH_LOG         "/dev/log"
+#endif
+
 #define BUFFER_SIZE       BUFSIZ
 
-/* This is a stupid server, it doesn't expect >3 min inactivity */
-#define INACTIVITY_TIMER  180 * 1000
+/* Max ports in -o pasv_ports=MIN-MAX, each is a descriptor per family */
+#define PASV_PORTS_MAX    1024
+
+/* Default listen() backlog of FTP control connections, -o backlog */
+#define LISTEN_BACKLOG    20
+
+/* SYN retries of active mode data connections, 3: ~15 sec connect timeout */
+#define CONNECT_SYNCNT    3
+
+/* This is a stupid server, it doesn't expect >3 min inactivity, sec */
+#define INACTIVITY_TIMER  180
+
+/* Log messages queued per process, max length, max/sec of notice and below */
+#define LOGBUF_SLOTS      64
+#define LOGBUF_LINE       512
+#define LOGBUF_RATE       1000
+
+/* Transfer log buffer per process, and sec until a timer flushes it */
+#define XFERLOG_BUFSZ     4096
+#define XFERLOG_FLUSH     5
+
+/* Max time to wait for a busy log at exit, msec */
+#define LOGBUF_WAIT       100
+
+/* Size of each listing cache slot, bigger listings are not cached */
+#define CACHE_SLOTSZ      65536
+
+/* Files kept open per session for SIZE, MDTM, RETR, and for how long, sec */
+#define FCACHE_NUM        4
+#define FCACHE_TTL        2
+
+/* Workers dying before serving a client, in a row, before giving up */
+#define POOL_FAILURES     5
+
+/* Default max depth of LIST -R, and max subdirectory names queued per level */
+#define LIST_DEPTH        16
+#define LIST_QUEUE_MAX    262144
+
+/* Max file size for SIZE in ASCII mode with -o single, the file is read */
+#define SIZE_ASCII_MAX    1048576
 
 /* TFTP Packet Types (New) */
 #define OACK              06	/* option acknowledgement */
@@ -78,8 +126,11 @@
 /* TFTP Minimum segment size, specific to uftpd */
 #define MIN_SEGSIZE       32
 
+/* Filtered before the arguments are evaluated, they may be costly */
 #define LOGIT(severity, code, fmt, args...)				\
 	do {								\
+		if ((severity) > loglevel)				\
+			break;						\
 		if (code)						\
 			logit(severity, fmt ". Error %d: %s%s",		\
 			      ##args, code, strerror(code),		\
@@ -92,23 +143,92 @@
 #define WARN(code, fmt, args...) LOGIT(LOG_WARNING, code, fmt, ##args)
 #define LOG(fmt, args...)        LOGIT(LOG_NOTICE, 0, fmt, ##args)
 #define INFO(fmt, args...)       LOGIT(LOG_INFO, 0, fmt, ##args)
+#ifdef DISABLE_DEBUG
+/* Compiled out, configure --disable-debug, still type checked */
+#define DBG(fmt, args...)        do { if (0) logit(LOG_DEBUG, fmt, ##args); } while (0)
+#else
 #define DBG(fmt, args...)        LOGIT(LOG_DEBUG, 0, fmt, ##args)
+#endif
 
 extern char *prognm;
 extern char *home;		/* Server root/home directory       */
 extern int   inetd;             /* Bool: conflicts with daemonize   */
 extern int   background;	/* Bool: conflicts with inetd       */
 extern int   chrooted;		/* Bool: are we chrooted?           */
+extern int   forked;		/* Bool: pool worker, do not fork   */
 extern int   loglevel;
 extern int   do_syslog;         /* Bool: False at daemon start      */
 extern int   do_ftp;            /* Port: FTP port, or disabled      */
 extern int   do_tftp;           /* Port: TFTP port, or disabled     */
 extern char *pasv_addr;	/* Address passed to client in pasv mode */
 extern int   do_insecure;	/* Bool: Allow writable root or not */
+extern int   list_cache;	/* Number of listing cache slots    */
+extern int   list_depth;	/* Max depth of LIST -R, 0: disable */
+extern int   prefork_min;	/* Min idle FTP workers, 0: disable */
+extern int   prefork_max;	/* Max idle FTP workers             */
+extern int   do_single;		/* Bool: FTP sessions share a loop  */
+extern int   shards;		/* SO_REUSEPORT listeners, per family */
+extern int   do_affinity;	/* Bool: pin session hosts to CPUs  */
+extern int   backlog;		/* listen() backlog, FTP control    */
+extern int   pasv_min;		/* PASV port range, 0: any port     */
+extern int   pasv_max;
+extern int   ftp_timeout;	/* Inactivity timeout, sec, per protocol */
+extern int   tftp_timeout;
 extern struct passwd *pw;       /* FTP user's passwd entry          */
 
 typedef struct tftphdr tftp_t;
 
+/*
+ * Directory being listed, see dir.c.  In streaming mode entries are
+ * handed out straight from the getdents64() buffer, in sorted mode the
+ * buffer is an arena holding all names, and names[] is sorted.
+ */
+typedef struct {
+	int      fd;
+	int      sorted;	/* Bool: all names read and sorted */
+	char    *buf;		/* getdents64() buffer, or arena */
+	size_t   bufsz;
+	size_t   len;		/* Bytes read into buf */
+	size_t   pos;		/* Offset of next record in buf */
+	char   **names;		/* Sorted mode: pointers into arena */
+	int      num;		/* Sorted mode: number of names */
+	int      i;		/* Sorted mode: next name */
+	unsigned char type;	/* d_type of last entry read */
+	int      err;		/* errno of a failed read, listing cut short */
+} dir_t;
+
+/* Listing cache key, the directory and everything affecting its output */
+typedef struct {
+	dev_t    dev;
+	ino_t    ino;
+	struct timespec mtime;
+	char     facts[10];
+	char     mode;
+} lskey_t;
+
+/*
+ * Directory level in a recursive listing, LIST -R.  Names of the
+ * subdirectories found are queued and listed when the level is done,
+ * depth first, like ls -R.  Only the current path is kept in memory.
+ */
+typedef struct walk {
+	struct walk *up;	/* Parent directory */
+	char    *path;		/* Client path, for the heading */
+	int      depth;
+	char    *queue;		/* Subdirectory names, NUL separated */
+	size_t   len;
+	size_t   size;
+	size_t   pos;		/* Next name in queue */
+} walk_t;
+
+/* File looked up by SIZE, MDTM or RETR, see fcache.c */
+typedef struct {
+	char    *key;		/* cwd and path as given, NULL if unused */
+	int      fd;
+	int      readable;	/* Bool: else an O_PATH descriptor */
+	time_t   when;
+} fcache_t;
+
 typedef enum {
 	PENDING_NONE=0,
 	PENDING_LIST,
@@ -116,11 +236,13 @@ typedef enum {
 	PENDING_STOR
 } pend_t;
 
-typedef struct {
+typedef struct ctrl {
 	int sd;
 	int type;
 
 	char cwd[PATH_MAX];
+	int  root_fd;		/* FTP root, for open_path() */
+	fcache_t fcache[FCACHE_NUM];
 
 	struct sockaddr_storage server_sa;
 	struct sockaddr_storage client_sa;
@@ -131,10 +253,21 @@ typedef struct {
 	/* Event loop context and session watchers */
 	uev_t      io_watcher, data_watcher, timeout_watcher;
 	uev_ctx_t *ctx;
+	int        shared;	/* Bool: ctx shared with other sessions */
+	struct ctrl *next;	/* Ended shared sessions, see session_exit() */
+	time_t     active;	/* Last activity, see session_touch() */
+	int        idle_max;	/* Inactivity timeout, sec */
 
 	/* Session buffer */
 	char    *buf;		/* Pointer to segment buffer */
 	size_t   bufsz;		/* Size of buf */
+	char    *rbuf;		/* FTP commands received, bufsz */
+	size_t   rlen;		/* Bytes in rbuf */
+	char    *obuf;		/* Replies not yet sent, see send_msg() */
+	size_t   olen;		/* Bytes in obuf */
+	size_t   osize;		/* Size of obuf */
+	dir_t   *stat_d;	/* STAT of directory being sent */
+	char    *stat_dir;	/* Path of stat_d */
 
 	char     facts[10];
 	pend_t   pending; 	/* Pending op: LIST, RETR, STOR */
@@ -142,24 +275,57 @@ typedef struct {
 	char    *file;	        /* Current file name to fetch */
 	off_t    offset;	/* Offset/block in current file, for REST/WRQ */
 	FILE    *fp;		/* Current file in operation */
-	int      i;		/* i of d_num in 'd' */
-	int      d_num;		/* Number of entries in 'd' */
-	struct dirent **d;	/* Current directory in LIST op */
-	struct timeval tv;	/* Progress indicator */
+	int      i;		/* Entries read from 'd' */
+	int      d_num;		/* Entries in 'd', if sorted, -1 for single entry */
+	dir_t   *d;		/* Current directory in LIST op */
+	walk_t  *walk;		/* LIST -R, current level first */
+	lskey_t  lskey;		/* Listing cache key for 'd' */
+	char    *ls;		/* Listing from cache, or being cached */
+	size_t   lslen;		/* Length of 'ls' */
+	size_t   lspos;		/* Bytes of 'ls' sent so far */
+	time_t   progress;	/* Last progress message, clock_now() */
 
 	/* TFTP */
 	tftp_t  *th;		/* Same as buf, only as tftp_t */
 	size_t   segsize;	/* SEGSIZE, or per session negotiated */
-	int      timeout;	/* INACTIVITY_TIMER, or per session neg. */
+	int      timeout;	/* Retransmit timeout, per session neg. */
 	uint32_t tftp_options;	/* %1:blksize */
 
 	/* User credentials */
 	char name[20];
 	char pass[20];
 
+	/* Credentials access(2) checks against, for MLSD perm facts */
+	uid_t    uid;
+	gid_t    gid;
+	gid_t   *groups;
+	int      ngroups;
+
+	/* MLSD perm facts, directory of current entries */
+	char    *pdir;
+	dev_t    pdir_dev;
+	int      pdir_x;	/* Bool: searchable */
+	int      pdir_ro;	/* Bool: read-only file system */
+
+	/* MODE B, block being received, and rest of blocks being sent */
+	int      mode;		/* MODE_S or MODE_B */
+	uint8_t  blkhdr[3];	/* Block header */
+	int      blkhdr_len;	/* Header bytes received */
+	size_t   blkleft;	/* Data bytes left of block */
+	char    *blkout;	/* Not yet sent, headers included */
+	size_t   blkout_len;
+
 	/* PASV */
 	int data_sd;
 	int data_listen_sd;
+	int data_pool;		/* data_listen_sd from pasv.c pool, or -1 */
+
+	/* Transfer log, see xferlog.c */
+	char     xfer_dir;	/* 'o' download, 'i' upload, 0 none */
+	off_t    xfer_offset;	/* REST offset it started at */
+	uint64_t xfer_bytes;	/* Bytes transferred */
+	uint64_t xfer_start;	/* clock_usec() */
+	int      xfer_retrans;	/* TFTP blocks resent */
 
 	/* PORT/EPRT */
 	char        data_address[INET_ADDRSTR_LEN];
@@ -167,20 +333,71 @@ typedef struct {
 	sa_family_t data_family;
 } ctrl_t;
 
-ctrl_t *new_session(uev_ctx_t *ctx, int sd, int *rc);
+int     session_init(void);
+ctrl_t *new_session(uev_ctx_t *ctx, int sd, int isftp, int *rc);
 int     del_session(ctrl_t *ctrl, int isftp);
+void    session_exit(ctrl_t *ctrl);
+void    session_touch(ctrl_t *ctrl);
+time_t  clock_update(void);
+time_t  clock_now(void);
+uint64_t clock_usec(void);
 
 int     ftp_session(uev_ctx_t *ctx, int client);
+void    walk_free(ctrl_t *ctrl);
 int     tftp_session(uev_ctx_t *ctx, int client);
 
-char   *compose_path(ctrl_t *ctrl, char *path);
-char   *compose_abspath(ctrl_t *ctrl, char *path);
+char   *compose_path(ctrl_t *ctrl, char *path, char *buf, size_t len);
+char   *compose_abspath(ctrl_t *ctrl, char *path, char *buf, size_t len);
+int     open_path(ctrl_t *ctrl, char *path, int flags, mode_t mode);
+FILE   *fopen_path(ctrl_t *ctrl, char *path, char *mode);
 int     set_nonblock(int fd);
-int     open_socket(sa_family_t family, int port, int type, char *desc);
+void   *shm_alloc(size_t len);
+void    nofile(void);
+
+dir_t  *dir_open(char *path, int sorted);
+char   *dir_read(dir_t *dir);
+void    dir_close(dir_t *dir);
+
+int     pool_init(uev_ctx_t *ctx, uev_t *listeners, int num);
+void    pool_reap(pid_t pid);
+
+int     pasv_init(void);
+int     pasv_open(ctrl_t *ctrl);
+void    pasv_close(ctrl_t *ctrl);
+void    pasv_reap(pid_t pid);
+
+int     cache_init(int num);
+int     cache_key(ctrl_t *ctrl, struct stat *st, lskey_t *key);
+int     cache_get(lskey_t *key, char **buf, size_t *len);
+void    cache_put(lskey_t *key, char *buf, size_t len);
+
+int     fcache_stat(ctrl_t *ctrl, char *path, struct stat *st, int *readable);
+int     fcache_take(ctrl_t *ctrl, char *path, struct stat *st);
+void    fcache_flush(ctrl_t *ctrl);
+
+int     open_socket(sa_family_t family, int port, int type, int reuseport, char *desc);
+int     reuseport_steer(int sd, int num);
 void    convert_address(struct sockaddr_storage *ss, char *buf, size_t len);
 
 int     loglvl(char *level);
 void    logit(int severity, const char *fmt, ...);
+void    log_open(void);
+void    log_init(uev_ctx_t *ctx);
+void    log_exit(void);
+
+int     xferlog_open(char *file);
+void    xferlog_flush(void);
+void    xferlog_start(ctrl_t *ctrl, char dir);
+void    xferlog_done(ctrl_t *ctrl, int complete);
+
+int     stats_init(uev_ctx_t *ctx, char *path);
+void    stats_exit(void);
+void    stats_session(int isftp, int delta);
+void    stats_transfer(ctrl_t *ctrl, int complete, uint64_t us);
+uint64_t stats_start(void);
+void    stats_command(uint64_t start);
+void    stats_reply(int code);
+void    stats_log_dropped(unsigned num);
 
 #endif  /* UFTPD_H_ */
 
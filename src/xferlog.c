@@ -0,0 +1,171 @@
+/* Transfer log, in wu-ftpd xferlog format, -o xferlog=FILE
+ *
+ * Copyright (c) 2014-2026  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uftpd.h"
+#include <arpa/ftp.h>
+#include <ctype.h>
+
+/*
+ * One line per RETR, STOR, and TFTP RRQ and WRQ, completed or not, in the
+ * xferlog(5) format of wu-ftpd, so existing tools can read it:
+ *
+ *   current-time transfer-time remote-host bytes filename type action
+ *   direction access-mode username service auth-method auth-user status
+ *
+ * followed by fields of our own: the REST offset the transfer started
+ * at, transfer time in msec, bytes per second, and TFTP blocks resent.
+ *
+ * The file is opened by the master, before chroot, and inherited by all
+ * sessions.  Each process collects lines in a buffer of its own and
+ * appends them with a single write(), when full, when a session ends,
+ * and from a timer XFERLOG_FLUSH sec after the first line was buffered.
+ * So lines from different processes never interleave.  A line too long
+ * for the buffer is written by itself.  The timer only exists while the
+ * buffer holds lines, in the event loop of the session that logged the
+ * first one.  The master itself never logs transfers, so forked sessions
+ * never inherit any lines, or the timer.
+ */
+
+static int    fd = -1;
+static char   buf[XFERLOG_BUFSZ];
+static size_t len;
+static int    armed;		/* Flush timer created, buf not empty */
+static uev_t  timer;
+
+int xferlog_open(char *file)
+{
+	fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERR(errno, "Failed opening transfer log %s", file);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void append(char *line, size_t num)
+{
+	if (write(fd, line, num) != (ssize_t)num)
+		WARN(errno, "Failed writing transfer log");
+}
+
+void xferlog_flush(void)
+{
+	if (fd < 0 || !len)
+		return;
+
+	if (armed) {
+		uev_timer_stop(&timer);
+		close(timer.fd);
+		armed = 0;
+	}
+
+	append(buf, len);
+	len = 0;
+}
+
+static void flush_cb(uev_t *w, void *arg, int events)
+{
+	xferlog_flush();
+}
+
+/* Transfer of @ctrl->file started, @dir is 'o' for downloads, 'i' uploads */
+void xferlog_start(ctrl_t *ctrl, char dir)
+{
+	ctrl->xfer_dir     = dir;
+	ctrl->xfer_offset  = ctrl->offset;
+	ctrl->xfer_bytes   = 0;
+	ctrl->xfer_retrans = 0;
+	ctrl->xfer_start   = clock_usec();
+}
+
+/* Names may not have spaces, xferlog fields are space separated */
+static void name(ctrl_t *ctrl, char *path, size_t sz)
+{
+	char *file = ctrl->file ?: "";
+	char *cwd = ctrl->cwd;
+
+	if (file[0] == '/' || !strcmp(cwd, "/"))
+		cwd = "";
+	strlcpy(path, cwd, sz);
+	if (file[0] != '/')
+		strlcat(path, "/", sz);
+	if (strlcat(path, file, sz) >= sz)
+		DBG("Transfer log name of %s truncated", file);
+
+	for (char *ptr = path; *ptr; ptr++) {
+		if (isspace((unsigned char)*ptr))
+			*ptr = '_';
+	}
+}
+
+/* Transfer ended, @complete or aborted */
+void xferlog_done(ctrl_t *ctrl, int complete)
+{
+	char path[PATH_MAX], stamp[32], line[PATH_MAX + 256];
+	uint64_t us, ms, rate;
+	int istftp = !!ctrl->th;
+	char dir = ctrl->xfer_dir;
+	time_t now;
+	struct tm tm;
+	int n;
+
+	if (!dir)
+		return;
+
+	us = clock_usec() - ctrl->xfer_start;
+	stats_transfer(ctrl, complete, us);
+	ctrl->xfer_dir = 0;
+
+	if (fd < 0)
+		return;
+
+	ms   = us / 1000;
+	rate = ctrl->xfer_bytes * 1000000 / (us ?: 1);
+
+	now = time(NULL);
+	strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", localtime_r(&now, &tm));
+	name(ctrl, path, sizeof(path));
+
+	n = snprintf(line, sizeof(line), "%s %" PRIu64 " %s %" PRIu64 " %s %c _ %c a %s %s 0 * %c"
+		     " %jd %" PRIu64 " %" PRIu64 " %d\n",
+		     stamp, (ms + 500) / 1000, ctrl->clientaddr, ctrl->xfer_bytes, path,
+		     !istftp && ctrl->type == TYPE_A ? 'a' : 'b', dir, ctrl->name[0] ? ctrl->name : "*",
+		     istftp ? "tftp" : "ftp", complete ? 'c' : 'i',
+		     (intmax_t)ctrl->xfer_offset, ms, rate, ctrl->xfer_retrans);
+	if (n < 0 || (size_t)n >= sizeof(line))
+		return;
+
+	if (len + n > sizeof(buf))
+		xferlog_flush();
+	if ((size_t)n > sizeof(buf)) {
+		append(line, n);
+		return;
+	}
+
+	if (!len && !uev_timer_init(ctrl->ctx, &timer, flush_cb, NULL, XFERLOG_FLUSH * 1000, 0))
+		armed = 1;
+	memcpy(&buf[len], line, n);
+	len += n;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Verify MODE B, block mode: several downloads, an upload and a listing
+# over one data connection, each file ended by an EOF block, MLST on the
+# control connection leaves it alone.
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+
+mkdir -m 777 "$DIR/upload"
+
+print "Transfers over one MODE B data connection ..."
+python3 - "$DIR" <<-EOF || FAIL "MODE B failed"
+	import ftplib, os, socket, struct, sys
+	def recvn(sd, n):
+	    buf = b""
+	    while len(buf) < n:
+	        chunk = sd.recv(n - len(buf))
+	        assert chunk, "data connection closed"
+	        buf += chunk
+	    return buf
+	def download(sd):
+	    data = b""
+	    while True:
+	        flags, count = struct.unpack(">BH", recvn(sd, 3))
+	        data += recvn(sd, count)
+	        if flags & 0x40:
+	            return data
+	ftp = ftplib.FTP()
+	ftp.connect("127.0.0.1", 21, timeout=5)
+	ftp.login()
+	ftp.voidcmd("TYPE I")
+	ftp.voidcmd("MODE B")
+	sd = socket.create_connection(ftp.makepasv(), timeout=5)
+	orig = open(sys.argv[1] + "/testfile.txt", "rb").read()
+	for i in range(10):
+	    ftp.sendcmd("RETR testfile.txt")
+	    assert download(sd) == orig, "corrupt download"
+	    ftp.voidresp()
+	data = os.urandom(20000)
+	ftp.sendcmd("STOR upload/modeb.bin")
+	sd.sendall(struct.pack(">BH", 0, 10000) + data[:10000])
+	sd.sendall(struct.pack(">BH", 0x40, 10000) + data[10000:])
+	ftp.voidresp()
+	assert open(sys.argv[1] + "/upload/modeb.bin", "rb").read() == data, "corrupt upload"
+	ftp.sendcmd("NLST foo")
+	assert b"xyzzy" in download(sd).split(), "missing xyzzy"
+	ftp.voidresp()
+	ftp.putcmd("MLST testfile.txt")
+	assert "type=file" in ftp.getmultiline(), "MLST not on control connection"
+	ftp.sendcmd("RETR testfile.txt")
+	assert download(sd) == orig, "data connection lost after MLST"
+	ftp.voidresp()
+	ftp.quit()
+	EOF
+
+OK
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Verify -o pasv_ports=MIN-MAX, the pool of pre-opened PASV sockets: all
+# data connections use ports in the range, a port is given back after a
+# transfer, and a client gets 425 when all of them are busy.  With -o
+# single, a port given back by ABOR or QUIT works for the next session.
+
+# Capture the build dir before lib.sh's setup() changes directory.
+bindir=$(pwd)/../src
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+
+# Daemonized, see zombies.sh, separate port from the lib.sh instance
+"$bindir/uftpd" "$DIR" -o ftp=2398,tftp=0,pasv_ports=2410-2411 -l err -p "$DIR/ppid" >"$DIR/plog" 2>&1
+sleep 1
+echo "$(cat "$DIR/ppid" 2>/dev/null)" >> "$DIR/PIDs"
+
+print "Downloading via a pool of two PASV ports ..."
+python3 - "$DIR" <<-EOF || FAIL "PASV port pool failed"
+	import ftplib, io, re, sys
+	def client():
+	    ftp = ftplib.FTP()
+	    ftp.connect("127.0.0.1", 2398, timeout=5)
+	    ftp.login()
+	    return ftp
+	def pasv(ftp):
+	    return int(re.search(r"\|\|\|(\d+)\|", ftp.sendcmd("EPSV")).group(1))
+	orig = open(sys.argv[1] + "/testfile.txt", "rb").read()
+	a, b, c = client(), client(), client()
+	for i in range(10):
+	    buf = io.BytesIO()
+	    a.retrbinary("RETR testfile.txt", buf.write)
+	    assert buf.getvalue() == orig, "corrupt download"
+	ports = { pasv(a), pasv(b) }
+	assert ports == { 2410, 2411 }, "ports %r outside range" % ports
+	try:
+	    c.sendcmd("EPSV")
+	    assert False, "third client got a PASV port"
+	except ftplib.error_temp as e:
+	    assert str(e).startswith("425"), e
+	a.quit()
+	assert pasv(c) in ports, "port not given back"
+	EOF
+
+"$bindir/uftpd" "$DIR" -o ftp=2393,tftp=0,single,pasv_ports=2412-2412 -l err -p "$DIR/spid" >"$DIR/slog" 2>&1
+sleep 1
+echo "$(cat "$DIR/spid" 2>/dev/null)" >> "$DIR/PIDs"
+
+print "Reusing a PASV port after ABOR and QUIT, with -o single ..."
+python3 - <<-EOF || FAIL "PASV port not usable after ABOR/QUIT"
+	import ftplib
+	def client():
+	    ftp = ftplib.FTP()
+	    ftp.connect("127.0.0.1", 2393, timeout=5)
+	    ftp.login()
+	    return ftp
+	for cmd in ("ABOR", "QUIT"):
+	    a = client()
+	    a.sendcmd("EPSV")
+	    try:
+	        a.sendcmd(cmd)
+	    except ftplib.error_temp:
+	        pass
+	    b = client()
+	    assert "testfile.txt" in b.nlst(), "no listing after " + cmd
+	    b.quit()
+	EOF
+
+OK
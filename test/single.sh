@@ -0,0 +1,48 @@
+#!/bin/sh
+# Verify -o single, all FTP sessions served by one session host process:
+# many clients connected at once, each listing and downloading, must not
+# grow the number of uftpd processes beyond the master and its host.
+
+# Capture the build dir before lib.sh's setup() changes directory.
+bindir=$(pwd)/../src
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+check_dep pgrep
+
+base=$(pgrep -c uftpd || echo 0)
+
+# Daemonized, see zombies.sh, separate port from the lib.sh instance
+"$bindir/uftpd" "$DIR" -o ftp=2399,tftp=0,single -l err -p "$DIR/spid" >"$DIR/slog" 2>&1
+sleep 1
+echo "$(cat "$DIR/spid" 2>/dev/null)" >> "$DIR/PIDs"
+
+print "Connecting 20 clients at once ..."
+python3 - "$DIR" >"$DIR/single.out" <<-EOF || FAIL "session failed"
+	import ftplib, io, subprocess, sys
+	clients = []
+	for i in range(20):
+	    ftp = ftplib.FTP()
+	    ftp.connect("127.0.0.1", 2399, timeout=5)
+	    ftp.login()
+	    clients.append(ftp)
+	orig = open(sys.argv[1] + "/testfile.txt", "rb").read()
+	for ftp in clients:
+	    buf = io.BytesIO()
+	    ftp.retrbinary("RETR testfile.txt", buf.write)
+	    assert buf.getvalue() == orig, "corrupt download"
+	    assert "xyzzy" in ftp.nlst("foo"), "missing xyzzy"
+	print(subprocess.run(["pgrep", "-c", "uftpd"], capture_output=True, text=True).stdout.strip())
+	for ftp in clients:
+	    ftp.quit()
+	EOF
+
+after=$(cat "$DIR/single.out")
+dprint "uftpd processes before: $base, with 20 clients: $after"
+[ "$after" -le "$((base + 2))" ] || FAIL "uftpd processes grew $base -> $after, sessions forked?"
+
+OK
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Verify STAT with a path lists it over the control connection, like
+# LIST but without a data connection, and STAT without one reports the
+# session status.
+#set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+
+stat()
+{
+	python3 - "$1" <<-EOF
+		import ftplib, sys
+		ftp = ftplib.FTP()
+		ftp.connect("127.0.0.1", 21, timeout=5)
+		ftp.login()
+		print(ftp.sendcmd("STAT " + sys.argv[1]))
+		ftp.quit()
+		EOF
+}
+
+print "STAT of directory"
+stat foo >"$DIR/stat.out" || FAIL "STAT foo failed"
+cat "$DIR/stat.out"
+head -1 "$DIR/stat.out" |grep -q "^213-"      || FAIL "missing 213- reply"
+grep -q "^d.* bar$" "$DIR/stat.out"           || FAIL "missing bar"
+grep -q "^-.* xyzzy$" "$DIR/stat.out"         || FAIL "missing xyzzy"
+tail -1 "$DIR/stat.out" |grep -q "^213 "      || FAIL "missing 213 end"
+
+print "STAT of file"
+stat foo/baz >"$DIR/stat.out" || FAIL "STAT foo/baz failed"
+grep -q "^-.* baz$" "$DIR/stat.out"           || FAIL "missing baz"
+
+print "STAT of session"
+stat "" >"$DIR/stat.out" || FAIL "STAT failed"
+grep -q "Logged in as anonymous" "$DIR/stat.out" || FAIL "missing session status"
+
+OK
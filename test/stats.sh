@@ -0,0 +1,63 @@
+#!/bin/sh
+# Verify -o stats=PATH: counters shared by all sessions, read from the
+# Unix socket in Prometheus text format, including the histograms.
+
+# Capture the build dir before lib.sh's setup() changes directory.
+bindir=$(pwd)/../src
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+
+# Daemonized, see zombies.sh, separate port from the lib.sh instance
+"$bindir/uftpd" "$DIR" -o ftp=2395,tftp=0,stats="$DIR/stats" -l err -p "$DIR/spid" >"$DIR/slog" 2>&1
+sleep 1
+echo "$(cat "$DIR/spid" 2>/dev/null)" >> "$DIR/PIDs"
+
+print "Counting sessions, a download, commands and replies ..."
+python3 - "$DIR" <<-EOF || FAIL "Stats failed"
+	import ftplib, os, socket, sys, time
+	size = os.path.getsize(sys.argv[1] + "/testfile.txt")
+	def stats():
+	    sd = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	    sd.connect(sys.argv[1] + "/stats")
+	    text = b""
+	    while True:
+	        data = sd.recv(4096)
+	        if not data:
+	            break
+	        text += data
+	    sd.close()
+	    return dict(l.rsplit(" ", 1) for l in text.decode().splitlines() if not l.startswith("#"))
+	# Two sessions, each a forked process of its own
+	one = ftplib.FTP()
+	one.connect("127.0.0.1", 2395, timeout=5)
+	one.login()
+	two = ftplib.FTP()
+	two.connect("127.0.0.1", 2395, timeout=5)
+	two.login()
+	one.retrbinary("RETR testfile.txt", lambda data: None)
+	try:
+	    two.sendcmd("RETR nonexistent")
+	except ftplib.error_perm:
+	    pass
+	m = stats()
+	assert m['uftpd_sessions_active{proto="ftp"}'] == "2", m
+	one.quit()
+	two.quit()
+	time.sleep(1)
+	m = stats()
+	assert m['uftpd_sessions_active{proto="ftp"}'] == "0", m
+	assert m['uftpd_sessions_total{proto="ftp"}'] == "2", m
+	assert m['uftpd_transfers_total{proto="ftp",direction="download",status="complete"}'] == "1", m
+	assert m['uftpd_transfer_bytes_total{proto="ftp",direction="download"}'] == str(size), m
+	assert m['uftpd_transfer_rate_bytes_per_second_count'] == "1", m
+	assert m['uftpd_transfer_rate_bytes_per_second_bucket{le="+Inf"}'] == "1", m
+	assert int(m['uftpd_ftp_command_duration_seconds_count']) >= 6, m
+	assert m['uftpd_ftp_replies_total{class="5xx"}'] == "1", m
+	EOF
+
+OK
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Verify symlinks inside the FTP root are followed, also those going up
+# from the current directory and absolute ones, which in the chroot are
+# in the FTP root, while links out of the root are refused.
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+
+mkdir -p "$DIR/releases" "$DIR/pub"
+echo "version 1" > "$DIR/releases/v1.txt"
+ln -s ../releases/v1.txt "$DIR/pub/latest"
+ln -s /releases/v1.txt   "$DIR/pub/absolute"
+ln -s ../../../../etc/passwd "$DIR/pub/escape"
+
+print "Following symlinks up a directory, absolute, and out of the root ..."
+python3 - <<-EOF || FAIL "Symlinks failed"
+	import ftplib, io
+	ftp = ftplib.FTP()
+	ftp.connect("127.0.0.1", 21, timeout=5)
+	ftp.login()
+	ftp.voidcmd("TYPE I")
+	ftp.cwd("pub")
+	for name in ("latest", "absolute", "/pub/latest"):
+	    assert ftp.size(name) == 10, name
+	    buf = io.BytesIO()
+	    ftp.retrbinary("RETR " + name, buf.write)
+	    assert buf.getvalue() == b"version 1\n", name
+	for name in ("escape", "../pub/escape"):
+	    try:
+	        ftp.size(name)
+	    except ftplib.error_perm:
+	        continue
+	    raise AssertionError(name + " is outside the FTP root")
+	ftp.quit()
+	EOF
+
+OK
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Verify -o ftp_timeout=SEC: an idle session is closed after the timeout,
+# while one that keeps sending commands outlives it.
+
+# Capture the build dir before lib.sh's setup() changes directory.
+bindir=$(pwd)/../src
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+
+# Daemonized, see zombies.sh, separate port from the lib.sh instance
+"$bindir/uftpd" "$DIR" -o ftp=2397,tftp=0,ftp_timeout=2 -l err -p "$DIR/tpid" >"$DIR/tlog" 2>&1
+sleep 1
+echo "$(cat "$DIR/tpid" 2>/dev/null)" >> "$DIR/PIDs"
+
+print "Idle and busy sessions with a 2 sec inactivity timeout ..."
+python3 - <<-EOF || FAIL "Inactivity timeout failed"
+	import socket, time
+	def client():
+	    sd = socket.create_connection(("127.0.0.1", 2397), timeout=10)
+	    sd.recv(128)
+	    return sd
+	idle, busy = client(), client()
+	start = time.time()
+	for i in range(4):
+	    busy.sendall(b"NOOP\r\n")
+	    assert busy.recv(128).startswith(b"200"), "busy session closed"
+	    time.sleep(1)
+	assert idle.recv(128) == b"", "idle session not closed"
+	busy.sendall(b"NOOP\r\n")
+	assert busy.recv(128).startswith(b"200"), "busy session closed"
+	start = time.time()
+	assert busy.recv(128) == b"", "busy session never closed"
+	assert time.time() - start < 4, "busy session closed late"
+	EOF
+
+OK
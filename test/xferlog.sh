@@ -0,0 +1,67 @@
+#!/bin/sh
+# Verify -o xferlog=FILE: one line per transfer, in xferlog(5) format,
+# with size, direction, REST offset and completion status.
+
+# Capture the build dir before lib.sh's setup() changes directory.
+bindir=$(pwd)/../src
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+check_dep python3
+
+mkdir -m 777 "$DIR/upload"
+
+# Daemonized, see zombies.sh, separate port from the lib.sh instance
+"$bindir/uftpd" "$DIR" -o ftp=2396,tftp=0,xferlog="$DIR/xferlog" -l err -p "$DIR/xpid" >"$DIR/xlog" 2>&1
+sleep 1
+echo "$(cat "$DIR/xpid" 2>/dev/null)" >> "$DIR/PIDs"
+
+print "Logging a download, a resumed download and an upload ..."
+python3 - "$DIR" <<-EOF || FAIL "Transfer log failed"
+	import ftplib, io, os, sys, time
+	size = os.path.getsize(sys.argv[1] + "/testfile.txt")
+	ftp = ftplib.FTP()
+	ftp.connect("127.0.0.1", 2396, timeout=5)
+	ftp.login()
+	ftp.retrbinary("RETR testfile.txt", lambda data: None)
+	ftp.retrbinary("RETR testfile.txt", lambda data: None, rest=10)
+	ftp.cwd("upload")
+	ftp.storbinary("STOR xferlog.bin", io.BytesIO(b"x" * 1000))
+	ftp.quit()
+	time.sleep(1)
+	lines = [l.split() for l in open(sys.argv[1] + "/xferlog")]
+	assert len(lines) == 3, "expected 3 lines, got %d" % len(lines)
+	# size name type action direction access user service ... status offset
+	assert lines[0][7:18] == [str(size), "/testfile.txt", "b", "_", "o", "a", "anonymous", "ftp", "0", "*", "c"], lines[0]
+	assert lines[1][7] == str(size - 10) and lines[1][18] == "10", lines[1]
+	assert lines[2][7:9] == ["1000", "/upload/xferlog.bin"] and lines[2][11] == "i", lines[2]
+	EOF
+
+print "Flushing an idle session, and a line longer than the buffer ..."
+python3 - "$DIR" <<-EOF || FAIL "Transfer log flush failed"
+	import ftplib, os, sys, time
+	# Path near PATH_MAX, its line does not fit the 4096 byte buffer
+	dirs = ["d%02d" % i + "x" * 250 for i in range(16)]
+	os.makedirs(os.path.join(sys.argv[1], *dirs))
+	open(os.path.join(sys.argv[1], *dirs, "long.txt"), "w").write("long")
+	ftp = ftplib.FTP()
+	ftp.connect("127.0.0.1", 2396, timeout=10)
+	ftp.login()
+	ftp.retrbinary("RETR testfile.txt", lambda data: None)
+	time.sleep(7)
+	lines = open(sys.argv[1] + "/xferlog").readlines()
+	assert len(lines) == 4, "idle line not flushed, got %d lines" % len(lines)
+	for d in dirs:
+	    ftp.cwd(d)
+	ftp.retrbinary("RETR long.txt", lambda data: None)
+	ftp.quit()
+	time.sleep(1)
+	lines = open(sys.argv[1] + "/xferlog").readlines()
+	assert len(lines) == 5 and len(lines[4]) > 4096, "long line lost"
+	assert lines[4].split()[8].endswith("/long.txt"), lines[4]
+	EOF
+
+OK